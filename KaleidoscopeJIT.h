@@ -17,32 +17,353 @@
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <set>
 #include <string>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+// Running totals of the memory the JIT has allocated for linked code.
+struct JITMemoryCounters {
+  std::atomic<uint64_t> CodeBytes{0};
+  std::atomic<uint64_t> DataBytes{0};
+  std::atomic<uint64_t> PeakBytes{0};
+
+  void add(std::atomic<uint64_t> &Counter, uint64_t Size) {
+    Counter += Size;
+    uint64_t Total = CodeBytes + DataBytes;
+    uint64_t Peak = PeakBytes;
+    while (Total > Peak && !PeakBytes.compare_exchange_weak(Peak, Total))
+      ;
+  }
+};
+
+// Memory for linked code and data, shared by every JIT in the process.
+// SectionMemoryManager maps fresh pages for each module's code, read-only
+// data and writable data, so even a one-line function costs three pages.
+// This packs each module into one block of a large slab instead, which keeps
+// thousands of sessions of small functions cheap.
+//
+// Modules are linked while code from other modules on the same pages runs,
+// so no page can be flipped between writable and executable. Each slab is
+// mapped twice instead, side by side: the linker writes through the writable
+// view, and code and read-only data are used from the executable one. Both
+// views of a slab are within reach of a 32-bit PC-relative reference.
+class SharedCodeAllocator {
+public:
+  // A block of a slab, as seen through each view.
+  struct Block {
+    uint8_t *Writable = nullptr;
+    uint8_t *Executable = nullptr;
+    size_t Size = 0;
+  };
+
+  enum : size_t { SlabSize = 1 << 20, MinAlignment = 16 };
+
+  // Never destroyed, since a JIT in a static may outlive it otherwise.
+  static SharedCodeAllocator &get() {
+    static SharedCodeAllocator *Allocator = new SharedCodeAllocator;
+    return *Allocator;
+  }
+
+  // Returns an empty block if no memory could be mapped.
+  Block allocate(size_t Size, size_t Alignment) {
+    Size = alignTo(std::max<size_t>(Size, 1), MinAlignment);
+    Alignment = std::max<size_t>(Alignment, MinAlignment);
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &S : Slabs) {
+      Block B = take(*S.second, Size, Alignment);
+      if (B.Size)
+        return B;
+    }
+    if (Slab *S = mapSlab(Size + Alignment))
+      return take(*S, Size, Alignment);
+    return Block();
+  }
+
+  void release(const Block &B) {
+    if (!B.Size)
+      return;
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto SI = Slabs.upper_bound(B.Writable);
+    if (SI == Slabs.begin())
+      return;
+    Slab &S = *(--SI)->second;
+    // Forgotten at a fork, see the constructor.
+    if (B.Writable >= S.Writable + S.Size)
+      return;
+
+    size_t Start = B.Writable - S.Writable, Size = B.Size;
+    auto Next = S.Free.lower_bound(Start);
+    if (Next != S.Free.end() && Next->first == Start + Size) {
+      Size += Next->second;
+      Next = S.Free.erase(Next);
+    }
+    if (Next != S.Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Start) {
+        Start = Prev->first;
+        Size += Prev->second;
+        S.Free.erase(Prev);
+      }
+    }
+    S.Free[Start] = Size;
+    S.Used -= B.Size;
+
+    // Keep the last slab even if it's empty, so a session that keeps
+    // replacing one module doesn't map a slab for each.
+    if (!S.Used && Slabs.size() > 1) {
+      munmap(S.Writable, 2 * S.Size);
+      Slabs.erase(SI);
+    }
+  }
+
+  // Bytes mapped for slabs, counting each view once.
+  uint64_t getMappedBytes() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    uint64_t Bytes = 0;
+    for (auto &S : Slabs)
+      Bytes += S.second->Size;
+    return Bytes;
+  }
+
+private:
+  struct Slab {
+    uint8_t *Writable;
+    uint8_t *Executable;
+    size_t Size;
+    // Free ranges, from offset to size.
+    std::map<size_t, size_t> Free;
+    size_t Used = 0;
+  };
+
+  SharedCodeAllocator() {
+    // A forked child shares its slabs with the parent, so it must not
+    // allocate from them. It forgets them, leaving them mapped for whatever
+    // it inherited. The zygote forks with no other threads, so nobody holds
+    // Mutex.
+    pthread_atfork(nullptr, nullptr, [] { get().Slabs.clear(); });
+  }
+
+  // Carve Size bytes at Alignment out of the first free range of S they fit
+  // in, or return an empty block.
+  static Block take(Slab &S, size_t Size, size_t Alignment) {
+    for (auto I = S.Free.begin(), E = S.Free.end(); I != E; ++I) {
+      size_t RangeStart = I->first, RangeEnd = I->first + I->second;
+      size_t Start = alignTo(RangeStart, Alignment);
+      if (Start + Size > RangeEnd)
+        continue;
+      S.Free.erase(I);
+      if (Start > RangeStart)
+        S.Free[RangeStart] = Start - RangeStart;
+      if (RangeEnd > Start + Size)
+        S.Free[Start + Size] = RangeEnd - Start - Size;
+      S.Used += Size;
+      Block B;
+      B.Writable = S.Writable + Start;
+      B.Executable = S.Executable + Start;
+      B.Size = Size;
+      return B;
+    }
+    return Block();
+  }
+
+  // Map a slab of at least MinSize bytes, both views of it from one
+  // reservation so they are next to each other.
+  Slab *mapSlab(size_t MinSize) {
+    size_t Size = alignTo(std::max<size_t>(MinSize, SlabSize),
+                          sys::Process::getPageSizeEstimate());
+    int FD = memfd_create("tylang-code", MFD_CLOEXEC);
+    if (FD < 0)
+      return nullptr;
+    void *Base = mmap(nullptr, 2 * Size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool Mapped =
+        Base != MAP_FAILED && ftruncate(FD, Size) == 0 &&
+        mmap(Base, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, FD,
+             0) != MAP_FAILED &&
+        mmap((uint8_t *)Base + Size, Size, PROT_READ | PROT_EXEC,
+             MAP_SHARED | MAP_FIXED, FD, 0) != MAP_FAILED;
+    close(FD);
+    if (!Mapped) {
+      if (Base != MAP_FAILED)
+        munmap(Base, 2 * Size);
+      return nullptr;
+    }
+
+    auto S = std::make_unique<Slab>();
+    S->Writable = (uint8_t *)Base;
+    S->Executable = S->Writable + Size;
+    S->Size = Size;
+    S->Free[0] = Size;
+    Slab *Result = S.get();
+    Slabs[S->Writable] = std::move(S);
+    return Result;
+  }
+
+  std::mutex Mutex;
+  // By the address of their writable view.
+  std::map<uint8_t *, std::unique_ptr<Slab>> Slabs;
+};
+
+// Links one module into a block from the SharedCodeAllocator and keeps
+// JITMemoryCounters up to date. There is one per module, and it gives the
+// block back when it goes away.
+class SharedMemoryManager : public RTDyldMemoryManager {
+public:
+  SharedMemoryManager(std::shared_ptr<JITMemoryCounters> Counters)
+      : Counters(std::move(Counters)) {}
+
+  ~SharedMemoryManager() override {
+    deregisterEHFrames();
+    Counters->CodeBytes -= CodeBytes;
+    Counters->DataBytes -= DataBytes;
+    SharedCodeAllocator::get().release(Reservation);
+    for (auto &B : Blocks)
+      SharedCodeAllocator::get().release(B);
+  }
+
+  // The linker says how much the whole module needs before it allocates any
+  // section, so it can all go in one block.
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override {
+    size_t Alignment = std::max({CodeAlign, RODataAlign, RWDataAlign, 1u});
+    Reservation = SharedCodeAllocator::get().allocate(
+        CodeSize + CodeAlign + RODataSize + RODataAlign + RWDataSize +
+            RWDataAlign,
+        Alignment);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    CodeBytes += Size;
+    Counters->add(Counters->CodeBytes, Size);
+    return allocateSection(Size, Alignment, true);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    DataBytes += Size;
+    Counters->add(Counters->DataBytes, Size);
+    return allocateSection(Size, Alignment, IsReadOnly);
+  }
+
+  // Code and read-only data are used from the executable view. Relocations
+  // aren't resolved yet, so they see those addresses.
+  using RTDyldMemoryManager::notifyObjectLoaded;
+  void notifyObjectLoaded(RuntimeDyld &RTDyld,
+                          const object::ObjectFile &) override {
+    for (auto &S : ExecutableSections)
+      RTDyld.mapSectionAddress(S.first, (uint64_t)(uintptr_t)S.second);
+  }
+
+  // The unwinder reads the frames where the code sees them.
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override {
+    RTDyldMemoryManager::registerEHFrames((uint8_t *)(uintptr_t)LoadAddr,
+                                          LoadAddr, Size);
+  }
+
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    sys::Memory::InvalidateInstructionCache(Reservation.Executable,
+                                            Reservation.Size);
+    for (auto &B : Blocks)
+      sys::Memory::InvalidateInstructionCache(B.Executable, B.Size);
+    return false;
+  }
+
+private:
+  // Take Size bytes from the reservation, or from a block of their own if it
+  // falls short. Returns the writable address.
+  uint8_t *allocateSection(uintptr_t Size, unsigned Alignment,
+                           bool Executable) {
+    Alignment = std::max(Alignment, 1u);
+    uint8_t *Writable = nullptr, *ExecutableAddr = nullptr;
+    size_t Offset = alignTo(ReservationUsed, Alignment);
+    if (Offset + Size <= Reservation.Size) {
+      ReservationUsed = Offset + Size;
+      Writable = Reservation.Writable + Offset;
+      ExecutableAddr = Reservation.Executable + Offset;
+    }
+    if (!Writable) {
+      auto B = SharedCodeAllocator::get().allocate(Size, Alignment);
+      if (!B.Size)
+        return nullptr;
+      Blocks.push_back(B);
+      Writable = B.Writable;
+      ExecutableAddr = B.Executable;
+    }
+    if (Executable)
+      ExecutableSections.push_back({Writable, ExecutableAddr});
+    return Writable;
+  }
+
+  std::shared_ptr<JITMemoryCounters> Counters;
+  uint64_t CodeBytes = 0;
+  uint64_t DataBytes = 0;
+  SharedCodeAllocator::Block Reservation;
+  size_t ReservationUsed = 0;
+  // Sections that didn't fit in the reservation.
+  std::vector<SharedCodeAllocator::Block> Blocks;
+  std::vector<std::pair<uint8_t *, uint8_t *>> ExecutableSections;
+};
+
 class KaleidoscopeJIT {
 public:
+  struct Statistics {
+    uint64_t CodeBytes;
+    uint64_t DataBytes;
+    uint64_t PeakBytes;
+    unsigned LiveModules;
+    unsigned ModulesAdded;
+    unsigned ModulesRemoved;
+  };
+
+  // A retained object, and when it was linked: after the LinkedAfter'th
+  // object, counting from 1, was added, or 0 if it hasn't been linked.
+  // Linking binds each name the object uses to its newest definition at
+  // the time, so adding the objects in order and linking each one at that
+  // point binds every name as it was bound.
+  struct RetainedObject {
+    MemoryBufferRef Object;
+    unsigned LinkedAfter;
+  };
+
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
-  using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
-  KaleidoscopeJIT()
+  // Cache, if given, supplies objects for modules it has seen before and
+  // receives every object compiled.
+  KaleidoscopeJIT(ObjectCache *Cache = nullptr)
       : Resolver(createLegacyLookupResolver(
             ES,
             [this](const std::string &Name) { return findMangledSymbol(Name); },
@@ -51,32 +372,288 @@ public:
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
                     [this](VModuleKey) {
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                          std::make_shared<SharedMemoryManager>(Counters),
+                          Resolver};
+                    },
+                    ObjLayerT::NotifyLoadedFtor(),
+                    [this](VModuleKey K, const object::ObjectFile &,
+                           const RuntimeDyld::LoadedObjectInfo &) {
+                      Modules[K].LinkedAt = ModulesAdded;
                     }),
-        CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
+        Cache(Cache) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    CompileCallbackMgr = cantFail(
+        createLocalCompileCallbackManager(TM->getTargetTriple(), ES, 0));
+    IndirectStubsMgr =
+        createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())();
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  // Named metadata listing, one MDString per operand, functions that M calls
+  // by their address rather than by name.
+  static constexpr const char *DirectCalleesMetadata = "tylang.direct_callees";
+
+  // Compile M to an object and add that. Linking waits for the first lookup
+  // of a symbol it defines.
   VModuleKey addModule(std::unique_ptr<Module> M) {
+    std::vector<std::string> DirectCallees;
+    if (auto *MD = M->getNamedMetadata(DirectCalleesMetadata))
+      for (auto *Op : MD->operands())
+        DirectCallees.push_back(
+            mangle(cast<MDString>(Op->getOperand(0))->getString().str()));
+    return addObject(SimpleCompiler(getCompileTargetMachine(), Cache)(*M),
+                     std::move(DirectCallees));
+  }
+
+  // The target machine that emits code on the calling thread. A target
+  // machine builds large tables for its subtarget the first time it emits
+  // anything, so every JIT in the process shares one per thread instead of
+  // having its own. Target machines aren't thread-safe, so not one for all.
+  static TargetMachine &getCompileTargetMachine() {
+    static thread_local std::unique_ptr<TargetMachine> CompileTM(
+        EngineBuilder().selectTarget());
+    return *CompileTM;
+  }
+
+  // Add an object file that was compiled elsewhere, e.g. on another thread.
+  // Like a module, what it defines shadows earlier definitions. Imported
+  // names the object uses without referring to them, so the modules that
+  // define them are kept while it is around.
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj,
+                       std::vector<std::string> Imported = {}) {
+    std::vector<std::string> Defined;
+    auto File = object::ObjectFile::createObjectFile(Obj->getMemBufferRef());
+    if (File) {
+      for (auto &Sym : (*File)->symbols()) {
+        uint32_t Flags = Sym.getFlags();
+        if (!(Flags & object::SymbolRef::SF_Global))
+          continue;
+        if (auto Name = Sym.getName())
+          ((Flags & object::SymbolRef::SF_Undefined) ? Imported : Defined)
+              .push_back(*Name);
+        else
+          consumeError(Name.takeError());
+      }
+    } else {
+      consumeError(File.takeError());
+    }
+
     auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
+    recordModule(K, std::move(Defined), std::move(Imported));
+    if (RetainObjects)
+      Modules[K].Object = MemoryBuffer::getMemBufferCopy(
+          Obj->getBuffer(), Obj->getBufferIdentifier());
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
     return K;
   }
 
+  // Link K now rather than on the first lookup of a name it defines, so each
+  // name it uses binds to the newest definition there is now. Does nothing
+  // if K is linked already.
+  Error linkModule(VModuleKey K) {
+    if (Modules[K].LinkedAt)
+      return Error::success();
+    return ObjectLayer.emitAndFinalize(K);
+  }
+
+  // Keep a copy of every object added from now on, for getObjects.
+  void setRetainObjects(bool Retain) { RetainObjects = Retain; }
+
+  // The retained objects of the modules still in the JIT, oldest first.
+  std::vector<RetainedObject> getObjects() const {
+    std::vector<RetainedObject> Objects;
+    // When each of them was added.
+    std::vector<unsigned> AddedAt;
+    for (auto K : ModuleKeys) {
+      auto &Info = Modules.at(K);
+      if (Info.Object) {
+        Objects.push_back({Info.Object->getMemBufferRef(), Info.LinkedAt});
+        AddedAt.push_back(Info.AddedAt);
+      }
+    }
+    // Modules added since may have been removed, so count the ones left.
+    for (auto &Obj : Objects)
+      if (Obj.LinkedAfter)
+        Obj.LinkedAfter = upper_bound(AddedAt, Obj.LinkedAfter) - AddedAt.begin();
+    return Objects;
+  }
+
   void removeModule(VModuleKey K) {
+    ModuleInfo Info = std::move(Modules[K]);
+    Modules.erase(K);
     ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+    Superseded.erase(std::remove(Superseded.begin(), Superseded.end(), K),
+                     Superseded.end());
+    ModulesRemoved++;
+
+    // If K was the newest definition of a name, the one before it is live
+    // again.
+    for (auto &Name : Info.Defined) {
+      ResolvedSymbols.erase(Name);
+      auto &Definers = SymbolDefiners[Name];
+      bool WasNewest = Definers.back() == K;
+      Definers.erase(find(Definers, K));
+      if (Definers.empty()) {
+        SymbolDefiners.erase(Name);
+      } else if (WasNewest) {
+        ModuleInfo &Prev = Modules[Definers.back()];
+        if (Prev.LiveSymbols++ == 0 && Prev.Reported) {
+          Prev.Reported = false;
+          Superseded.erase(std::remove(Superseded.begin(), Superseded.end(),
+                                       Definers.back()),
+                           Superseded.end());
+        }
+      }
+    }
+    for (auto &Name : Info.Imported)
+      Importers[Name].erase(K);
+
+    // Code K was linked against may now be unreachable.
+    for (auto &MI : Modules)
+      if (MI.second.PinnedBy.erase(K))
+        checkSuperseded(MI.first);
+
+    cantFail(ObjectLayer.removeObject(K));
+  }
+
+  // Modules that nothing can reach any more: every name they define has a
+  // newer definition, and every module that could have linked against them
+  // is gone. The caller is responsible for removing them, once no thread is
+  // still running their code.
+  std::vector<VModuleKey> takeSupersededModules() {
+    return std::move(Superseded);
+  }
+
+  Statistics getStatistics() const {
+    return {Counters->CodeBytes, Counters->DataBytes, Counters->PeakBytes,
+            (unsigned)ModuleKeys.size(), ModulesAdded, ModulesRemoved};
+  }
+
+  // Memory currently allocated for linked code and its data.
+  uint64_t getAllocatedBytes() const {
+    return Counters->CodeBytes + Counters->DataBytes;
+  }
+
+  // Define Name as a stub that calls Compile the first time it is called.
+  // Compile returns the address of the implementation, which the stub jumps
+  // to from then on. Defining a name that already has a stub repoints it at
+  // the new compile callback.
+  Error addLazyFunction(const std::string &Name,
+                        std::function<JITTargetAddress()> Compile) {
+    std::string MangledName = mangle(Name);
+    auto CCAddr = CompileCallbackMgr->getCompileCallback(
+        [this, MangledName, Compile]() {
+          JITTargetAddress Addr = Compile();
+          cantFail(IndirectStubsMgr->updatePointer(MangledName, Addr));
+          return Addr;
+        });
+    if (!CCAddr)
+      return CCAddr.takeError();
+
+    ResolvedSymbols.erase(MangledName);
+    if (IndirectStubsMgr->findStub(MangledName, false))
+      return IndirectStubsMgr->updatePointer(MangledName, *CCAddr);
+    return IndirectStubsMgr->createStub(MangledName, *CCAddr,
+                                        JITSymbolFlags::Exported);
+  }
+
+  // Point the stub for Name straight at Addr, creating the stub if there is
+  // none yet.
+  Error updateStub(const std::string &Name, JITTargetAddress Addr) {
+    std::string MangledName = mangle(Name);
+    if (IndirectStubsMgr->findStub(MangledName, false))
+      return IndirectStubsMgr->updatePointer(MangledName, Addr);
+    ResolvedSymbols.erase(MangledName);
+    return IndirectStubsMgr->createStub(MangledName, Addr,
+                                        JITSymbolFlags::Exported);
   }
 
   JITSymbol findSymbol(const std::string Name) {
     return findMangledSymbol(mangle(Name));
   }
 
+  // Returns the final address of Name, compiling its module if needed, or 0
+  // if it is not defined anywhere. Results are cached until a newer module
+  // redefines the name, so callers can bind the address directly into code.
+  JITTargetAddress getSymbolAddress(const std::string &Name) {
+    std::string MangledName = mangle(Name);
+    auto I = ResolvedSymbols.find(MangledName);
+    if (I != ResolvedSymbols.end())
+      return I->second;
+
+    auto Sym = findMangledSymbol(MangledName);
+    if (!Sym)
+      return 0;
+    JITTargetAddress Addr = cantFail(Sym.getAddress());
+    ResolvedSymbols[MangledName] = Addr;
+    return Addr;
+  }
+
 private:
+  struct ModuleInfo {
+    std::vector<std::string> Defined;
+    std::vector<std::string> Imported;
+    // Names for which this is the newest definition.
+    unsigned LiveSymbols = 0;
+    // Modules that were around when a name this module defines was
+    // superseded and that use that name, so they may be linked against this
+    // module's definition.
+    std::set<VModuleKey> PinnedBy;
+    // Whether it is in Superseded.
+    bool Reported = false;
+    // ModulesAdded once it was added, and once it was linked, or 0 until
+    // it is.
+    unsigned AddedAt = 0;
+    unsigned LinkedAt = 0;
+    // Set if objects are retained.
+    std::unique_ptr<MemoryBuffer> Object;
+  };
+
+  void recordModule(VModuleKey K, std::vector<std::string> Defined,
+                    std::vector<std::string> Imported) {
+    std::vector<VModuleKey> Shadowed;
+    for (auto &Name : Defined) {
+      // Any name this module defines shadows an earlier definition, so drop
+      // it from the address cache.
+      ResolvedSymbols.erase(Name);
+
+      auto &Definers = SymbolDefiners[Name];
+      if (!Definers.empty()) {
+        VModuleKey Prev = Definers.back();
+        ModuleInfo &PrevInfo = Modules[Prev];
+        PrevInfo.LiveSymbols--;
+        for (auto Importer : Importers[Name])
+          if (Importer != Prev)
+            PrevInfo.PinnedBy.insert(Importer);
+        Shadowed.push_back(Prev);
+      }
+      Definers.push_back(K);
+    }
+
+    for (auto &Name : Imported)
+      Importers[Name].insert(K);
+
+    ModuleInfo &Info = Modules[K];
+    Info.LiveSymbols = Defined.size();
+    Info.Defined = std::move(Defined);
+    Info.Imported = std::move(Imported);
+    ModuleKeys.push_back(K);
+    ModulesAdded++;
+    Info.AddedAt = ModulesAdded;
+
+    for (auto Prev : Shadowed)
+      checkSuperseded(Prev);
+  }
+
+  void checkSuperseded(VModuleKey K) {
+    ModuleInfo &Info = Modules[K];
+    if (Info.LiveSymbols || !Info.PinnedBy.empty() || Info.Reported)
+      return;
+    Info.Reported = true;
+    Superseded.push_back(K);
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -100,16 +677,26 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
+    // A stub is the canonical definition of a lazily compiled function.
+    if (auto Sym = IndirectStubsMgr->findStub(Name, ExportedSymbolsOnly))
+      return Sym;
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
     for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+      if (auto Sym = ObjectLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
         return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
+    // Process symbols never move, so each one is only searched for once.
+    auto PI = ProcessSymbols.find(Name);
+    if (PI != ProcessSymbols.end())
+      return JITSymbol(PI->second, JITSymbolFlags::Exported);
+    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name)) {
+      ProcessSymbols[Name] = SymAddr;
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+    }
 
 #ifdef _WIN32
     // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
@@ -129,8 +716,22 @@ private:
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
-  CompileLayerT CompileLayer;
+  ObjectCache *Cache;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackMgr;
+  std::unique_ptr<IndirectStubsManager> IndirectStubsMgr;
+  std::shared_ptr<JITMemoryCounters> Counters =
+      std::make_shared<JITMemoryCounters>();
   std::vector<VModuleKey> ModuleKeys;
+  std::map<VModuleKey, ModuleInfo> Modules;
+  // Every module defining each name, oldest first.
+  std::map<std::string, std::vector<VModuleKey>> SymbolDefiners;
+  std::map<std::string, std::set<VModuleKey>> Importers;
+  std::vector<VModuleKey> Superseded;
+  unsigned ModulesAdded = 0;
+  unsigned ModulesRemoved = 0;
+  bool RetainObjects = false;
+  std::map<std::string, JITTargetAddress> ResolvedSymbols;
+  std::map<std::string, JITTargetAddress> ProcessSymbols;
 };
 
 } // end namespace orc
@@ -0,0 +1,494 @@
+#include "ast.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Ahead-of-time compilation (--emit=obj|lib|exe). Each input file goes
+// through the same codegen as the JIT into a module of its own, in its own
+// context, on up to --jobs threads, and comes out as bitcode. The modules are
+// then linked and optimized as a whole, so functions are inlined across
+// files and whatever nothing can call is dropped, before the program is
+// emitted as:
+//
+// - obj: a relocatable object. Every definition is exported under its own
+//   name with the C calling convention, and the top-level expressions run,
+//   in order, from tylang_main.
+// - lib: the same object in a static library, plus a C header declaring
+//   what it exports.
+// - exe: an executable whose main runs the top-level expressions, linked
+//   with the system C compiler. Nothing of LLVM or the JIT is in it.
+// - module: the definitions as a precompiled module for `import`.
+// - protos: a table of every prototype, and of the symbols definitions are
+//   exported under, for building the prelude into tylang. Nothing is
+//   compiled.
+//
+// The object code of imported modules and the prelude goes into every
+// object, library and executable along with the program's own. An object
+// has it merged in with ld -r.
+//
+// Redefining a function binds later code in the same file to the new body
+// and leaves earlier code calling the old one, like the eager JIT. Defining
+// the same name in two files is a link error.
+
+enum class EmitKind { None, Object, Library, Executable, Module, Protos };
+
+static EmitKind TheEmitKind = EmitKind::None;
+// Where to write the output. Defaults to a name derived from the input.
+static std::string AOTOutput;
+// Prepended to the names definitions are exported under, so a library's
+// can't clash with its host's.
+static std::string AOTSymbolPrefix;
+static std::unique_ptr<llvm::TargetMachine> AOTTargetMachine;
+
+// A definition or top-level expression, in source order.
+struct AOTItem {
+  std::unique_ptr<FunctionAST> Fn;
+  // The name a top-level expression is compiled under. Empty for a
+  // definition.
+  std::string EntryName;
+};
+
+// One input file.
+struct AOTUnit {
+  std::string File;
+  std::vector<AOTItem> Items;
+  llvm::SmallVector<char, 0> Bitcode;
+};
+
+static std::deque<AOTUnit> AOTUnits;
+// Defined names, in order of first definition.
+static std::vector<std::string> AOTDefinitions;
+// Entry points of the top-level expressions, in source order.
+static std::vector<std::string> AOTTopLevelExprs;
+
+// Default output name for a program whose first input is Input, or "" for
+// stdin.
+static std::string defaultAOTOutput(const std::string &Input) {
+  std::string Stem = Input.empty() ? "a" : llvm::sys::path::stem(Input).str();
+  switch (TheEmitKind) {
+  case EmitKind::Object:
+    return Stem + ".o";
+  case EmitKind::Library:
+    return "lib" + Stem + ".a";
+  case EmitKind::Module:
+    return Stem + ".tym";
+  case EmitKind::Protos:
+    return Stem + ".inc";
+  default:
+    return Input.empty() ? "a.out" : Stem;
+  }
+}
+
+// Set up the target and MainCodeGen. Objects are position independent, so
+// they link into PIE executables and shared objects alike, and are compiled
+// for a generic CPU of the host's architecture so they run on any machine
+// that can run the compiler.
+static bool startAOT() {
+  std::string Triple = llvm::sys::getDefaultTargetTriple();
+  std::string Error;
+  const llvm::Target *T = llvm::TargetRegistry::lookupTarget(Triple, Error);
+  if (!T) {
+    fprintf(stderr, "Could not find target %s: %s\n", Triple.c_str(), Error.c_str());
+    return false;
+  }
+  llvm::TargetOptions Options;
+  AOTTargetMachine.reset(T->createTargetMachine(Triple, "generic", "", Options, llvm::Reloc::PIC_));
+  if (TheSession->ObjectCache)
+    TheSession->ObjectCache->setTarget(*AOTTargetMachine);
+
+  TheSession->MainCodeGen = std::make_unique<CodeGen>(AOTTargetMachine->createDataLayout(), false);
+  TheSession->MainCodeGen->Module->setTargetTriple(Triple);
+  return true;
+}
+
+// Start collecting the definitions and expressions of File.
+static void beginAOTUnit(const std::string &File) {
+  AOTUnits.emplace_back();
+  AOTUnits.back().File = File;
+}
+
+// Its prototype is registered straight away, so code in any file can call
+// it whatever order the files compile in.
+static void addAOTDefinition(std::unique_ptr<FunctionAST> Fn) {
+  addFunctionProto(Fn->getProto());
+  const std::string &Name = Fn->getName();
+  if (std::find(AOTDefinitions.begin(), AOTDefinitions.end(), Name) == AOTDefinitions.end())
+    AOTDefinitions.push_back(Name);
+  AOTUnits.back().Items.push_back({std::move(Fn), ""});
+}
+
+static void addAOTTopLevelExpr(std::unique_ptr<FunctionAST> Fn) {
+  AOTTopLevelExprs.push_back("__anon_expr" + std::to_string(AOTTopLevelExprs.size()));
+  AOTUnits.back().Items.push_back({std::move(Fn), AOTTopLevelExprs.back()});
+}
+
+// Compile U to bitcode in a context of its own. Errors are reported and the
+// code that has them left out, as the JIT does.
+static void compileAOTUnit(AOTUnit &U) {
+  CodeGen CG(AOTTargetMachine->createDataLayout(), false);
+  llvm::Module &M = *CG.Module;
+  M.setModuleIdentifier(U.File);
+  M.setTargetTriple(AOTTargetMachine->getTargetTriple().str());
+
+  for (auto &Item : U.Items) {
+    if (!Item.EntryName.empty()) {
+      if (auto *FnIR = Item.Fn->codegen(CG))
+        FnIR->setName(Item.EntryName);
+      continue;
+    }
+
+    // Code already compiled keeps calling the old body under a private name.
+    const std::string &Name = Item.Fn->getName();
+    if (auto *Old = M.getFunction(Name)) {
+      if (!Old->isDeclaration()) {
+        Old->setName(Name + ".old");
+        Old->setLinkage(llvm::Function::InternalLinkage);
+      }
+    }
+    Item.Fn->codegen(CG);
+  }
+
+  optimizeModule(M, 2);
+  llvm::raw_svector_ostream OS(U.Bitcode);
+  llvm::WriteBitcodeToFile(M, OS);
+}
+
+// Compile every unit, on up to Jobs threads.
+static void compileAOTUnits(unsigned Jobs) {
+  std::atomic<size_t> Next{0};
+  auto Work = [&Next, S = TheSession] {
+    SessionScope Scope(S);
+    for (size_t i; (i = Next++) < AOTUnits.size();)
+      compileAOTUnit(AOTUnits[i]);
+  };
+
+  std::vector<std::thread> Threads;
+  for (unsigned i = 1; i < std::min<size_t>(Jobs, AOTUnits.size()); ++i)
+    Threads.emplace_back(Work);
+  Work();
+  for (auto &T : Threads)
+    T.join();
+}
+
+// Link every unit's bitcode into MainCodeGen's module.
+static bool linkAOTUnits() {
+  llvm::Linker L(*TheSession->MainCodeGen->Module);
+  for (auto &U : AOTUnits) {
+    llvm::MemoryBufferRef Buffer(llvm::StringRef(U.Bitcode.data(), U.Bitcode.size()), U.File);
+    auto M = llvm::parseBitcodeFile(Buffer, *TheSession->MainCodeGen->Context);
+    if (!M) {
+      llvm::logAllUnhandledErrors(M.takeError(), llvm::errs(), "Could not read " + U.File + ": ");
+      return false;
+    }
+    if (L.linkInModule(std::move(*M)))
+      return false;
+  }
+  return true;
+}
+
+// Whole-program optimization of the linked module. By now only the entry
+// points are external, so the rest can be inlined anywhere and dropped once
+// nothing calls it.
+static void optimizeLinkedModule(llvm::Module &M) {
+  llvm::PassManagerBuilder PMB;
+  PMB.OptLevel = 2;
+  PMB.Inliner = llvm::createFunctionInliningPass(2, 0, false);
+
+  llvm::legacy::PassManager MPM;
+  PMB.populateLTOPassManager(MPM);
+  MPM.run(M);
+}
+
+// Emit EntryName, an int(void) function that runs every top-level expression
+// and prints its result.
+static void codegenAOTEntry(CodeGen &CG, const std::string &EntryName) {
+  llvm::LLVMContext &C = *CG.Context;
+  auto *Int32Ty = llvm::Type::getInt32Ty(C);
+  auto *PrintfTy = llvm::FunctionType::get(Int32Ty, {llvm::Type::getInt8PtrTy(C)}, true);
+  llvm::FunctionCallee Printf = CG.Module->getOrInsertFunction("printf", PrintfTy);
+
+  auto *F = llvm::Function::Create(llvm::FunctionType::get(Int32Ty, false), llvm::Function::ExternalLinkage,
+                                   EntryName, CG.Module.get());
+  CG.Builder.SetInsertPoint(llvm::BasicBlock::Create(C, "entry", F));
+  llvm::Value *Format = nullptr;
+  for (auto &Name : AOTTopLevelExprs) {
+    // Left out if it failed to compile.
+    if (!CG.Module->getFunction(Name))
+      continue;
+    if (!Format)
+      Format = CG.Builder.CreateGlobalStringPtr("Evaluated to %f\n", "fmt");
+    llvm::Value *Result = CG.Builder.CreateCall(CG.Module->getFunction(Name), {}, "result");
+    CG.Builder.CreateCall(Printf, {Format, Result});
+  }
+  CG.Builder.CreateRet(llvm::ConstantInt::get(Int32Ty, 0));
+  llvm::verifyFunction(*F);
+}
+
+// Give every definition a C ABI entry point under its own name, which is
+// what C code, and the header, expect. The body moves to a private name so
+// the optimizer is free to change how it is called internally.
+static bool exportAOTDefinitions(CodeGen &CG) {
+  for (auto &Name : AOTDefinitions) {
+    auto P = findFunctionProto(Name);
+    llvm::Function *F = CG.Module->getFunction(Name);
+    if (!P || !F || F->isDeclaration())
+      continue;
+    auto *Entry = codegenCEntry(CG, *P, Name + "$c");
+    if (!Entry)
+      return false;
+    F->setName(Name + "$fast");
+    F->setLinkage(llvm::Function::InternalLinkage);
+    Entry->setName(AOTSymbolPrefix + Name);
+  }
+  return true;
+}
+
+// Write a C header declaring everything the library exports.
+static bool writeAOTHeader(const std::string &Path, bool HasEntry) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    fprintf(stderr, "Could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+
+  std::string Guard = llvm::sys::path::filename(Path).str();
+  for (char &C : Guard)
+    C = isalnum(C) ? toupper(C) : '_';
+
+  OS << "// Generated by tylang. Do not edit.\n"
+     << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  for (auto &Name : AOTDefinitions) {
+    auto P = findFunctionProto(Name);
+    if (!P)
+      continue;
+    OS << "double " << AOTSymbolPrefix << Name << "(";
+    auto &Args = P->getArgs();
+    for (size_t i = 0; i != Args.size(); ++i)
+      OS << (i ? ", " : "") << "double " << Args[i];
+    OS << (Args.empty() ? "void" : "") << ");\n";
+  }
+  if (HasEntry)
+    OS << "\n// Runs the program's top-level expressions, printing each result.\n"
+       << "int tylang_main(void);\n";
+  OS << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+  return !OS.has_error();
+}
+
+// Write every prototype as an entry of prelude.cpp's PreludeFunctions, after
+// declaring what the definitions are exported as.
+static bool writeProtosTable(const std::string &Path) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    fprintf(stderr, "Could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+
+  auto Protos = getFunctionProtos();
+  auto IsDefinition = [](const PrototypeAST &P) {
+    return std::find(AOTDefinitions.begin(), AOTDefinitions.end(), P.getName()) != AOTDefinitions.end();
+  };
+  OS << "// Generated by tylang. Do not edit.\n";
+  for (auto &P : Protos) {
+    if (!IsDefinition(*P))
+      continue;
+    OS << "extern \"C\" double " << AOTSymbolPrefix << P->getName() << "(";
+    auto &Args = P->getArgs();
+    for (size_t i = 0; i != Args.size(); ++i)
+      OS << (i ? ", " : "") << "double";
+    OS << (Args.empty() ? "void" : "") << ");\n";
+  }
+
+  OS << "\nstatic const PreludeFunction PreludeFunctions[] = {\n";
+  for (auto &P : Protos) {
+    OS << "    {\"" << P->getName();
+    for (auto &Arg : P->getArgs())
+      OS << " " << Arg;
+    OS << "\", ";
+    std::string Symbol = AOTSymbolPrefix + P->getName();
+    if (IsDefinition(*P))
+      OS << "\"" << Symbol << "\", (void *)&" << Symbol;
+    else
+      OS << "nullptr, nullptr";
+    OS << "},\n";
+  }
+  OS << "};\n";
+  return !OS.has_error();
+}
+
+static bool writeFile(const std::string &Path, llvm::StringRef Data) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+  OS << Data;
+  return !OS.has_error();
+}
+
+// Link Objs into Path with Linker, passing it Flags after the objects.
+static bool linkObjects(llvm::StringRef Linker, llvm::ArrayRef<llvm::StringRef> Objs,
+                        llvm::ArrayRef<llvm::StringRef> Flags, const std::string &Path) {
+  auto Program = llvm::sys::findProgramByName(Linker);
+  if (!Program) {
+    fprintf(stderr, "Could not find %s to link with\n", Linker.str().c_str());
+    return false;
+  }
+
+  std::vector<std::string> ObjPaths;
+  auto RemoveObjs = [&ObjPaths] {
+    for (auto &ObjPath : ObjPaths)
+      llvm::sys::fs::remove(ObjPath);
+  };
+  for (auto Obj : Objs) {
+    llvm::SmallString<128> ObjPath;
+    int FD;
+    if (llvm::sys::fs::createTemporaryFile("tylang", "o", FD, ObjPath)) {
+      fprintf(stderr, "Could not create a temporary object file\n");
+      RemoveObjs();
+      return false;
+    }
+    llvm::raw_fd_ostream OS(FD, true);
+    OS << Obj;
+    ObjPaths.push_back(std::string(ObjPath.str()));
+  }
+
+  std::string Error;
+  std::vector<llvm::StringRef> Args{*Program};
+  Args.insert(Args.end(), ObjPaths.begin(), ObjPaths.end());
+  Args.insert(Args.end(), Flags.begin(), Flags.end());
+  Args.push_back("-o");
+  Args.push_back(Path);
+  int Status = llvm::sys::ExecuteAndWait(*Program, Args, llvm::None, {}, 0, 0, &Error);
+  RemoveObjs();
+  if (Status != 0) {
+    fprintf(stderr, "Linking %s failed%s%s\n", Path.c_str(), Error.empty() ? "" : ": ", Error.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Compile, link, optimize and emit the program. Returns false on failure.
+static bool finishAOT(unsigned Jobs) {
+  if (TheEmitKind == EmitKind::Protos)
+    return writeProtosTable(AOTOutput);
+
+  // Modules are imported by the names their definitions have.
+  if (TheEmitKind == EmitKind::Module && !AOTSymbolPrefix.empty()) {
+    fprintf(stderr, "--symbol-prefix can't be used with --emit=module\n");
+    return false;
+  }
+
+  compileAOTUnits(Jobs);
+  if (!linkAOTUnits())
+    return false;
+
+  CodeGen &CG = *TheSession->MainCodeGen;
+  bindPreludeSymbols(*CG.Module);
+  for (auto &Name : AOTTopLevelExprs)
+    if (auto *F = CG.Module->getFunction(Name))
+      F->setLinkage(llvm::Function::InternalLinkage);
+  bool Executable = TheEmitKind == EmitKind::Executable;
+  std::string EntryName = Executable ? "main" : "tylang_main";
+  if (TheEmitKind == EmitKind::Module && !AOTTopLevelExprs.empty())
+    fprintf(stderr, "Top-level expressions are left out of modules\n");
+
+  if (Executable) {
+    // Only main is exported, so a definition named main just moves aside.
+    for (auto &Name : AOTDefinitions)
+      if (auto *F = CG.Module->getFunction(Name))
+        F->setLinkage(llvm::Function::InternalLinkage);
+    if (auto *F = CG.Module->getFunction(EntryName))
+      F->setName(EntryName + "$ty");
+  } else {
+    if (findFunctionProto(EntryName)) {
+      fprintf(stderr, "%s is reserved for the top-level expressions\n", EntryName.c_str());
+      return false;
+    }
+    if (!exportAOTDefinitions(CG))
+      return false;
+  }
+
+  bool HasEntry = Executable || (TheEmitKind != EmitKind::Module && !AOTTopLevelExprs.empty());
+  if (HasEntry)
+    codegenAOTEntry(CG, EntryName);
+
+  if (llvm::verifyModule(*CG.Module, &llvm::errs()))
+    return false;
+  optimizeLinkedModule(*CG.Module);
+
+  auto Obj = emitObject(*AOTTargetMachine, *CG.Module);
+  if (!Obj) {
+    fprintf(stderr, "Could not emit an object file\n");
+    return false;
+  }
+
+  auto Prelude = loadPreludeObject();
+  switch (TheEmitKind) {
+  case EmitKind::Object: {
+    // The object calls the prelude and imported modules by their symbols,
+    // so their code goes into it, as into a library.
+    std::vector<llvm::StringRef> Objs{Obj->getBuffer()};
+    for (auto &M : TheSession->ImportedModules)
+      Objs.push_back(M.Object->getBuffer());
+    if (Prelude)
+      Objs.push_back(Prelude->getBuffer());
+    if (Objs.size() == 1)
+      return writeFile(AOTOutput, Obj->getBuffer());
+    return linkObjects("ld", Objs, {"-r"}, AOTOutput);
+  }
+
+  case EmitKind::Library: {
+    std::string Member = llvm::sys::path::stem(AOTOutput).str() + ".o";
+    std::vector<llvm::NewArchiveMember> Members;
+    Members.emplace_back(llvm::MemoryBufferRef(Obj->getBuffer(), Member));
+    for (auto &M : TheSession->ImportedModules)
+      Members.emplace_back(M.Object->getMemBufferRef());
+    if (Prelude)
+      Members.emplace_back(Prelude->getMemBufferRef());
+    auto Kind = AOTTargetMachine->getTargetTriple().isOSDarwin() ? llvm::object::Archive::K_DARWIN
+                                                                  : llvm::object::Archive::K_GNU;
+    if (auto Err = llvm::writeArchive(AOTOutput, Members, true, Kind, true, false)) {
+      llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Could not write " + AOTOutput + ": ");
+      return false;
+    }
+    llvm::SmallString<128> Header(AOTOutput);
+    llvm::sys::path::replace_extension(Header, "h");
+    return writeAOTHeader(std::string(Header.str()), HasEntry);
+  }
+
+  case EmitKind::Executable: {
+    std::vector<llvm::StringRef> Objs{Obj->getBuffer()};
+    for (auto &M : TheSession->ImportedModules)
+      Objs.push_back(M.Object->getBuffer());
+    if (Prelude)
+      Objs.push_back(Prelude->getBuffer());
+    // cc knows where the C runtime and libraries live.
+    return linkObjects("cc", Objs, {"-lm"}, AOTOutput);
+  }
+
+  case EmitKind::Module: {
+    std::vector<std::unique_ptr<PrototypeAST>> Protos;
+    for (auto &Name : AOTDefinitions)
+      if (auto P = findFunctionProto(Name))
+        Protos.push_back(std::move(P));
+    return writeModuleFile(AOTOutput, AOTTargetMachine->getTargetTriple(), Protos, Obj->getBuffer());
+  }
+
+  case EmitKind::Protos:
+  case EmitKind::None:
+    break;
+  }
+  return false;
+}
@@ -0,0 +1,106 @@
+#include "ast.h"
+#include "tylang.h"
+
+// The C API declared in tylang.h. Each call works on its session with
+// TheSession set to it. Sessions are quiet: instead of going to stderr, errors
+// are kept for tylang_error, and the values of top-level expressions are
+// dropped.
+
+struct tylang_session {
+  Session S;
+  std::string Error;
+  // For each definition looked up, the address it had and its C entry point,
+  // so looking it up again returns the same entry until it is redefined.
+  std::map<std::string, std::pair<llvm::JITTargetAddress, llvm::JITTargetAddress>> CEntries;
+};
+
+void tylang_set_compile_threads(unsigned N) {
+  TheJobs = std::max(N, 1u);
+}
+
+tylang_session *tylang_session_create(void) {
+  auto *TS = new tylang_session;
+  SessionScope Scope(&TS->S);
+  TS->S.Echo = false;
+  if (LoadPrelude)
+    registerPrelude();
+  ensureJIT();
+  return TS;
+}
+
+void tylang_session_destroy(tylang_session *TS) {
+  delete TS;
+}
+
+static void setSessionError(tylang_session *TS, const std::vector<std::string> &Errors) {
+  TS->Error.clear();
+  for (auto &E : Errors)
+    TS->Error += E + "\n";
+}
+
+int tylang_compile(tylang_session *TS, const char *Source) {
+  SessionScope Scope(&TS->S);
+  std::vector<std::string> Errors;
+  // fmemopen can't open an empty buffer.
+  if (size_t Size = strlen(Source)) {
+    if (FILE *F = fmemopen((void *)Source, Size, "r")) {
+      CollectedErrors = &Errors;
+      runSource(F);
+      CollectedErrors = nullptr;
+      fclose(F);
+    } else {
+      Errors.push_back("Could not read the source");
+    }
+  }
+  setSessionError(TS, Errors);
+  return Errors.empty() ? 0 : -1;
+}
+
+const char *tylang_error(tylang_session *TS) {
+  return TS->Error.c_str();
+}
+
+void *tylang_lookup(tylang_session *TS, const char *Name, unsigned NumArgs) {
+  SessionScope Scope(&TS->S);
+  TS->Error.clear();
+  auto P = findFunctionProto(Name);
+  if (!P) {
+    setSessionError(TS, {"Unknown function " + std::string(Name)});
+    return nullptr;
+  }
+  if (P->getArgs().size() != NumArgs) {
+    setSessionError(TS, {std::string(Name) + " takes " + std::to_string(P->getArgs().size()) + " arguments"});
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> Lock(TS->S.JITMutex);
+  llvm::JITTargetAddress Addr = TS->S.JIT->getSymbolAddress(Name);
+  if (!Addr) {
+    setSessionError(TS, {"Could not find " + std::string(Name)});
+    return nullptr;
+  }
+  if (P->isExternal())
+    return (void *)Addr;
+
+  // Definitions use fastcc, so C callers go through an entry point. It binds
+  // to the definition current when it is linked.
+  auto &Entry = TS->CEntries[Name];
+  if (Entry.first != Addr) {
+    std::string EntryName = std::string(Name) + "$c";
+    CodeGen &CG = *TS->S.MainCodeGen;
+    if (!codegenCEntry(CG, *P, EntryName)) {
+      setSessionError(TS, {"Could not create an entry point for " + std::string(Name)});
+      return nullptr;
+    }
+    TS->S.JIT->addModule(CG.takeModule());
+    recycleCodeGen(TS->S.MainCodeGen);
+    Entry = {Addr, TS->S.JIT->getSymbolAddress(EntryName)};
+    reclaimModules();
+    if (!Entry.second) {
+      TS->CEntries.erase(Name);
+      setSessionError(TS, {"Could not link an entry point for " + std::string(Name)});
+      return nullptr;
+    }
+  }
+  return (void *)Entry.second;
+}
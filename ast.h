@@ -1,26 +1,58 @@
+#ifndef TYLANG_AST_H
+#define TYLANG_AST_H
+
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CallingConv.h"
 #include "llvm/IR/Constants.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Argument values of the function being interpreted, by name.
+using InterpFrame = std::map<std::string, double>;
+
+struct CodeGen;
+class BytecodeCompiler;
+struct BytecodeFunction;
 
 class ExprAST {
 public:
   virtual ~ExprAST() {}
-  virtual llvm::Value *codegen() = 0;
+  virtual llvm::Value *codegen(CodeGen &CG) = 0;
+  virtual bool interpret(InterpFrame &frame, double &result) = 0;
+  // Emits bytecode computing the expression and returns the register that
+  // holds the result, or -1 on error.
+  virtual int compileBytecode(BytecodeCompiler &C) = 0;
+  // True if the expression can be evaluated without calling any function.
+  virtual bool isTrivial() const { return false; }
+  // Appends the name of every function the expression calls.
+  virtual void getCallees(std::vector<std::string> &callees) const {}
+  // True if the expression is a single call whose arguments are all trivial.
+  // Sets callee and appends the argument values to argVals.
+  virtual bool getConstantCall(std::string &callee, std::vector<double> &argVals) { return false; }
 };
 
 class NumberExprAST : public ExprAST {
   double val;
 public:
   NumberExprAST(double val) : val(val) {}
-  virtual llvm::Value *codegen();
+  double getVal() const { return val; }
+  virtual llvm::Value *codegen(CodeGen &CG);
+  virtual bool interpret(InterpFrame &frame, double &result);
+  virtual int compileBytecode(BytecodeCompiler &C);
+  virtual bool isTrivial() const { return true; }
 };
 
 class VariableExprAST : public ExprAST {
   std::string name;
 public:
   VariableExprAST(const std::string &name): name(name) {}
-  virtual llvm::Value *codegen();
+  virtual llvm::Value *codegen(CodeGen &CG);
+  virtual bool interpret(InterpFrame &frame, double &result);
+  virtual int compileBytecode(BytecodeCompiler &C);
 };
 
 class BinaryExprAST : public ExprAST {
@@ -28,7 +60,14 @@ class BinaryExprAST : public ExprAST {
   std::unique_ptr<ExprAST> LHS, RHS;
 public:
   BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS): op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  virtual llvm::Value *codegen();
+  virtual llvm::Value *codegen(CodeGen &CG);
+  virtual bool interpret(InterpFrame &frame, double &result);
+  virtual int compileBytecode(BytecodeCompiler &C);
+  virtual bool isTrivial() const { return LHS->isTrivial() && RHS->isTrivial(); }
+  virtual void getCallees(std::vector<std::string> &callees) const {
+    LHS->getCallees(callees);
+    RHS->getCallees(callees);
+  }
 };
 
 class CallExprAST : public ExprAST {
@@ -36,17 +75,41 @@ class CallExprAST : public ExprAST {
   std::vector<std::unique_ptr<ExprAST>> args;
 public:
   CallExprAST(const std::string &callee, std::vector<std::unique_ptr<ExprAST>> args): callee(callee), args(std::move(args)) {}
-  virtual llvm::Value *codegen();
+  virtual llvm::Value *codegen(CodeGen &CG);
+  virtual bool interpret(InterpFrame &frame, double &result);
+  virtual int compileBytecode(BytecodeCompiler &C);
+  virtual void getCallees(std::vector<std::string> &callees) const {
+    callees.push_back(callee);
+    for (auto &arg : args)
+      arg->getCallees(callees);
+  }
+  virtual bool getConstantCall(std::string &callee, std::vector<double> &argVals) {
+    InterpFrame frame;
+    for (auto &arg : args) {
+      double val;
+      if (!arg->isTrivial() || !arg->interpret(frame, val))
+        return false;
+      argVals.push_back(val);
+    }
+    callee = this->callee;
+    return true;
+  }
 };
 
 class PrototypeAST {
   std::string name;
   std::vector<std::string> args;
+  // External functions are called from (or implemented in) C, so they keep
+  // the C calling convention. Everything else uses fastcc.
+  bool external;
 
 public:
-  PrototypeAST(const std::string &name, std::vector<std::string> args): name(name), args(std::move(args)) {}
+  PrototypeAST(const std::string &name, std::vector<std::string> args, bool external = false): name(name), args(std::move(args)), external(external) {}
   const std::string &getName() const { return name; }
-  virtual llvm::Function *codegen();
+  const std::vector<std::string> &getArgs() const { return args; }
+  bool isExternal() const { return external; }
+  llvm::CallingConv::ID getCallingConv() const { return external ? llvm::CallingConv::C : llvm::CallingConv::Fast; }
+  virtual llvm::Function *codegen(CodeGen &CG);
 };
 
 class FunctionAST {
@@ -54,5 +117,14 @@ class FunctionAST {
   std::unique_ptr<ExprAST> body;
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body) : proto(std::move(proto)), body(std::move(body)) {}
-  virtual llvm::Function *codegen();
-};
\ No newline at end of file
+  const std::string &getName() const { return proto->getName(); }
+  const PrototypeAST &getProto() const { return *proto; }
+  bool isTrivial() const { return body->isTrivial(); }
+  void getCallees(std::vector<std::string> &callees) const { body->getCallees(callees); }
+  bool getConstantCall(std::string &callee, std::vector<double> &argVals) { return body->getConstantCall(callee, argVals); }
+  virtual llvm::Function *codegen(CodeGen &CG);
+  virtual bool interpret(const std::vector<double> &argVals, double &result);
+  virtual bool compileBytecode(BytecodeFunction &F);
+};
+
+#endif // TYLANG_AST_H
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Startup time: the average wall time of many short runs of tylang, for a
+# script that only evaluates constants, which never needs LLVM, and for one
+# that defines and calls a function, which has to bring up the JIT.
+#
+#   bench/startup.sh [path/to/tylang] [runs]
+
+TYLANG=${1:-./tylang}
+RUNS=${2:-50}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+printf '1+2*3;\n4<5;\n' > "$DIR/trivial.ty"
+printf 'def sq(x) x*x;\nsq(7);\n' > "$DIR/jit.ty"
+
+# Average milliseconds per run of tylang with the given arguments.
+time_runs() {
+  Start=$(date +%s%N)
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    "$TYLANG" "$@" >/dev/null 2>&1 </dev/null
+    i=$((i + 1))
+  done
+  End=$(date +%s%N)
+  echo $(((End - Start) / RUNS / 1000))
+}
+
+report() {
+  Name=$1
+  shift
+  Us=$(time_runs "$@")
+  printf '%-28s %6d.%03d ms\n' "$Name" $((Us / 1000)) $((Us % 1000))
+}
+
+echo "$RUNS runs of $TYLANG"
+report "constants, jit" "$DIR/trivial.ty"
+report "constants, interp" --backend=interp "$DIR/trivial.ty"
+report "constants, vm" --backend=vm "$DIR/trivial.ty"
+report "definition, jit" "$DIR/jit.ty"
+report "definition, tiered" --backend=tiered "$DIR/jit.ty"
@@ -0,0 +1,421 @@
+#include "ast.h"
+
+// A register-based bytecode VM. Compiling an AST to bytecode is a single
+// pass with no optimization, so it sits between the tree-walking interpreter
+// and the JIT: much faster to produce than machine code, much faster to run
+// than the AST.
+//
+// Each function gets a window of registers. Its arguments occupy the first
+// registers of the window and temporaries follow. A call evaluates its
+// arguments into consecutive registers and the callee's window starts at the
+// first of them, so arguments are never copied.
+
+// GCC and clang support computed goto, which gives each opcode its own
+// indirect branch instead of funnelling every dispatch through one switch.
+#if defined(__GNUC__)
+#define TYLANG_THREADED_DISPATCH 1
+#endif
+
+enum Opcode : uint8_t {
+  OP_LOADK, // a = K[b]
+  OP_MOVE,  // a = b
+  OP_ADD,   // a = b + c
+  OP_SUB,   // a = b - c
+  OP_MUL,   // a = b * c
+  OP_LT,    // a = b < c
+  OP_ADDK,  // a = b + K[c]
+  OP_SUBK,  // a = b - K[c]
+  OP_MULK,  // a = b * K[c]
+  OP_CALL,  // a = function b called with the d registers starting at c
+  OP_CALLNATIVE,  // as OP_CALL for a host function
+  OP_CALLNATIVE1, // OP_CALLNATIVE with one argument
+  OP_CALLNATIVE2, // OP_CALLNATIVE with two arguments
+  OP_CALLNATIVE3, // OP_CALLNATIVE with three arguments
+  OP_RET,   // return a
+};
+
+struct Instr {
+  Opcode op;
+  uint16_t a, b, c;
+  // Arguments a call was compiled with. The callee may since have been
+  // redefined with a different number.
+  uint16_t d;
+};
+
+struct BytecodeFunction {
+  std::string name;
+  unsigned numArgs = 0;
+  unsigned numRegs = 0;
+  std::vector<Instr> code;
+  std::vector<double> constants;
+  // Set for externs, which run as native code. Kept if the name is defined
+  // later, for the calls already bound to it.
+  void *native = nullptr;
+  // Set once the name has a bytecode definition, which then takes over from
+  // native.
+  bool defined = false;
+  // Calls so far, counted only while tiering is enabled.
+  mutable unsigned calls = 0;
+};
+
+// Every function the VM knows about. Calls refer to functions by index, and a
+// deque keeps references stable as functions are added.
+static std::deque<BytecodeFunction> BytecodeFunctions;
+static std::map<std::string, unsigned> BytecodeSlots;
+// Machine code for each function once it has been tiered up, by slot. Calls
+// check it first, so storing an address here swaps the function in.
+static std::deque<std::atomic<void *>> TieredEntries;
+
+// A function whose call count reaches TierUpThreshold is reported to
+// HotFunctionHook. Zero disables counting.
+static unsigned TierUpThreshold = 0;
+static void (*HotFunctionHook)(unsigned slot) = nullptr;
+
+// Register file shared by all frames.
+static const unsigned VMStackSize = 1 << 18;
+static const unsigned VMMaxCallDepth = 10000;
+static std::unique_ptr<double[]> VMStack;
+static unsigned VMCallDepth = 0;
+
+static unsigned getBytecodeSlot(const std::string &name) {
+  auto I = BytecodeSlots.find(name);
+  if (I != BytecodeSlots.end())
+    return I->second;
+
+  unsigned slot = BytecodeFunctions.size();
+  BytecodeFunctions.emplace_back();
+  BytecodeFunctions.back().name = name;
+  TieredEntries.emplace_back(nullptr);
+  BytecodeSlots[name] = slot;
+  return slot;
+}
+
+class BytecodeCompiler {
+public:
+  BytecodeCompiler(BytecodeFunction &F) : F(F) {}
+
+  BytecodeFunction &F;
+  // Registers holding the function's arguments, by name.
+  std::map<std::string, unsigned> Vars;
+  // First free register. Temporaries are released by resetting it.
+  unsigned Top = 0;
+
+  int alloc(unsigned n = 1) {
+    unsigned reg = Top;
+    Top += n;
+    if (Top > UINT16_MAX)
+      return LogErrorI("Too many registers"), -1;
+    F.numRegs = std::max(F.numRegs, Top);
+    return reg;
+  }
+
+  int constant(double val) {
+    F.constants.push_back(val);
+    if (F.constants.size() > UINT16_MAX)
+      return LogErrorI("Too many constants"), -1;
+    return F.constants.size() - 1;
+  }
+
+  void emit(Opcode op, unsigned a, unsigned b = 0, unsigned c = 0, unsigned d = 0) {
+    F.code.push_back({op, (uint16_t)a, (uint16_t)b, (uint16_t)c, (uint16_t)d});
+  }
+};
+
+// compile
+
+int NumberExprAST::compileBytecode(BytecodeCompiler &C) {
+  int k = C.constant(val);
+  int reg = C.alloc();
+  if (k < 0 || reg < 0)
+    return -1;
+  C.emit(OP_LOADK, reg, k);
+  return reg;
+}
+
+int VariableExprAST::compileBytecode(BytecodeCompiler &C) {
+  auto V = C.Vars.find(name);
+  if (V == C.Vars.end())
+    return LogErrorI("Unknown variable name"), -1;
+  return V->second;
+}
+
+int BinaryExprAST::compileBytecode(BytecodeCompiler &C) {
+  Opcode regOp, constOp;
+  switch (op) {
+  case '+': regOp = OP_ADD; constOp = OP_ADDK; break;
+  case '-': regOp = OP_SUB; constOp = OP_SUBK; break;
+  case '*': regOp = OP_MUL; constOp = OP_MULK; break;
+  case '<': regOp = OP_LT; constOp = OP_LT; break;
+  default:
+    return LogErrorI("invalid binary operator"), -1;
+  }
+
+  // Fold a constant operand into the instruction. '+' and '*' commute, so a
+  // constant on either side will do.
+  ExprAST *Var = LHS.get();
+  auto *K = dynamic_cast<NumberExprAST *>(RHS.get());
+  if (!K && (op == '+' || op == '*')) {
+    K = dynamic_cast<NumberExprAST *>(LHS.get());
+    Var = RHS.get();
+  }
+
+  unsigned mark = C.Top;
+  if (K && constOp != regOp) {
+    int l = Var->compileBytecode(C);
+    int k = C.constant(K->getVal());
+    if (l < 0 || k < 0)
+      return -1;
+    C.Top = mark;
+    int dest = C.alloc();
+    if (dest < 0)
+      return -1;
+    C.emit(constOp, dest, l, k);
+    return dest;
+  }
+
+  int l = LHS->compileBytecode(C);
+  int r = RHS->compileBytecode(C);
+  if (l < 0 || r < 0)
+    return -1;
+  C.Top = mark;
+  int dest = C.alloc();
+  if (dest < 0)
+    return -1;
+  C.emit(regOp, dest, l, r);
+  return dest;
+}
+
+int CallExprAST::compileBytecode(BytecodeCompiler &C) {
+  // Calls are bound when they are compiled: to a bytecode function if one is
+  // defined, otherwise to the host function an extern names.
+  auto SI = BytecodeSlots.find(callee);
+  bool isBytecode = SI != BytecodeSlots.end() && BytecodeFunctions[SI->second].defined;
+  auto P = isBytecode ? nullptr : findFunctionProto(callee);
+  if (!isBytecode && !P)
+    return LogErrorI("Unknown function referenced"), -1;
+
+  unsigned numArgs = isBytecode ? BytecodeFunctions[SI->second].numArgs : P->getArgs().size();
+  if (numArgs != args.size())
+    return LogErrorI("Incorrect number of arguments"), -1;
+
+  unsigned slot = getBytecodeSlot(callee);
+  if (!isBytecode && !BytecodeFunctions[slot].native) {
+    BytecodeFunctions[slot].native = resolveNative(callee);
+    BytecodeFunctions[slot].numArgs = numArgs;
+    if (!BytecodeFunctions[slot].native)
+      return LogErrorI("Unresolved extern"), -1;
+  }
+
+  // Evaluate the arguments into consecutive registers.
+  unsigned mark = C.Top;
+  int base = C.alloc(args.size());
+  if (base < 0)
+    return -1;
+  for (unsigned i = 0, e = args.size(); i != e; ++i) {
+    int reg = args[i]->compileBytecode(C);
+    if (reg < 0)
+      return -1;
+    if ((unsigned)reg != base + i)
+      C.emit(OP_MOVE, base + i, reg);
+    C.Top = base + i + 1;
+  }
+
+  C.Top = mark;
+  int dest = C.alloc();
+  if (dest < 0)
+    return -1;
+
+  Opcode op = OP_CALL;
+  if (!isBytecode) {
+    switch (numArgs) {
+    case 1: op = OP_CALLNATIVE1; break;
+    case 2: op = OP_CALLNATIVE2; break;
+    case 3: op = OP_CALLNATIVE3; break;
+    default: op = OP_CALLNATIVE; break;
+    }
+  }
+  C.emit(op, dest, slot, base, numArgs);
+  return dest;
+}
+
+bool FunctionAST::compileBytecode(BytecodeFunction &F) {
+  F.numArgs = proto->getArgs().size();
+  F.numRegs = 0;
+  F.code.clear();
+  F.constants.clear();
+
+  BytecodeCompiler C(F);
+  for (auto &arg : proto->getArgs())
+    C.Vars[arg] = C.alloc();
+
+  int result = body->compileBytecode(C);
+  if (result < 0)
+    return false;
+
+  C.emit(OP_RET, result);
+  return true;
+}
+
+// Compile a definition and make it callable from bytecode. The slot is
+// marked defined first so the body can call itself.
+static bool compileBytecodeDefinition(FunctionAST &FnAST) {
+  BytecodeFunction F;
+  F.name = FnAST.getName();
+  unsigned slot = getBytecodeSlot(F.name);
+  bool wasDefined = BytecodeFunctions[slot].defined;
+  unsigned oldNumArgs = BytecodeFunctions[slot].numArgs;
+  BytecodeFunctions[slot].defined = true;
+  BytecodeFunctions[slot].numArgs = FnAST.getProto().getArgs().size();
+
+  if (!FnAST.compileBytecode(F)) {
+    BytecodeFunctions[slot].defined = wasDefined;
+    BytecodeFunctions[slot].numArgs = oldNumArgs;
+    return false;
+  }
+
+  F.native = BytecodeFunctions[slot].native;
+  F.defined = true;
+  BytecodeFunctions[slot] = std::move(F);
+  return true;
+}
+
+// execute
+
+// Call slot's machine code, if it still has any, setting called. The thread
+// enters an epoch before it reads the address, so the code can't be
+// reclaimed under it. Returns false if the call failed.
+static bool callTieredEntry(unsigned slot, const double *args, double &result, bool &called) {
+  EpochGuard Guard;
+  void *Entry = TieredEntries[slot].load(std::memory_order_acquire);
+  called = Entry;
+  return !Entry || callNative(Entry, args, BytecodeFunctions[slot].numArgs, result);
+}
+
+// Run F with its register window starting at regs.
+static bool executeBytecode(const BytecodeFunction &F, double *regs, double &result) {
+  if (regs + F.numRegs > VMStack.get() + VMStackSize || VMCallDepth >= VMMaxCallDepth)
+    return LogErrorI("Stack overflow");
+
+  const Instr *ip = F.code.data();
+  const double *K = F.constants.data();
+  const Instr *I;
+
+#ifdef TYLANG_THREADED_DISPATCH
+  // Must list the labels in Opcode order.
+  static void *DispatchTable[] = {
+      &&L_OP_LOADK, &&L_OP_MOVE, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL,
+      &&L_OP_LT, &&L_OP_ADDK, &&L_OP_SUBK, &&L_OP_MULK, &&L_OP_CALL,
+      &&L_OP_CALLNATIVE, &&L_OP_CALLNATIVE1, &&L_OP_CALLNATIVE2,
+      &&L_OP_CALLNATIVE3, &&L_OP_RET,
+  };
+#define VM_CASE(op) L_##op
+#define VM_DISPATCH() goto *DispatchTable[(I = ip++)->op]
+  VM_DISPATCH();
+#else
+#define VM_CASE(op) case op
+#define VM_DISPATCH() break
+  for (;;) switch ((I = ip++)->op) {
+#endif
+
+  VM_CASE(OP_LOADK):
+    regs[I->a] = K[I->b];
+    VM_DISPATCH();
+  VM_CASE(OP_MOVE):
+    regs[I->a] = regs[I->b];
+    VM_DISPATCH();
+  VM_CASE(OP_ADD):
+    regs[I->a] = regs[I->b] + regs[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_SUB):
+    regs[I->a] = regs[I->b] - regs[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_MUL):
+    regs[I->a] = regs[I->b] * regs[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_LT):
+    // Unordered or less than, matching the fcmp ult the JIT emits.
+    regs[I->a] = !(regs[I->b] >= regs[I->c]) ? 1.0 : 0.0;
+    VM_DISPATCH();
+  VM_CASE(OP_ADDK):
+    regs[I->a] = regs[I->b] + K[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_SUBK):
+    regs[I->a] = regs[I->b] - K[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_MULK):
+    regs[I->a] = regs[I->b] * K[I->c];
+    VM_DISPATCH();
+  VM_CASE(OP_CALL):
+  call_bytecode: {
+    const BytecodeFunction &Callee = BytecodeFunctions[I->b];
+    // The callee would read registers that aren't its arguments.
+    if (Callee.numArgs != I->d)
+      return LogErrorI("Incorrect number of arguments");
+    if (TieredEntries[I->b].load(std::memory_order_relaxed)) {
+      bool called;
+      if (!callTieredEntry(I->b, regs + I->c, regs[I->a], called))
+        return false;
+      if (called)
+        VM_DISPATCH();
+    }
+    if (TierUpThreshold && ++Callee.calls == TierUpThreshold)
+      HotFunctionHook(I->b);
+
+    double ret;
+    ++VMCallDepth;
+    bool ok = executeBytecode(Callee, regs + I->c, ret);
+    --VMCallDepth;
+    if (!ok)
+      return false;
+    regs[I->a] = ret;
+    VM_DISPATCH();
+  }
+  // A native call goes to the bytecode definition instead once there is one.
+  VM_CASE(OP_CALLNATIVE): {
+    const BytecodeFunction &Callee = BytecodeFunctions[I->b];
+    if (Callee.defined)
+      goto call_bytecode;
+    if (!callNative(Callee.native, regs + I->c, Callee.numArgs, regs[I->a]))
+      return false;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CALLNATIVE1): {
+    if (BytecodeFunctions[I->b].defined)
+      goto call_bytecode;
+    auto *Fn = (double (*)(double))BytecodeFunctions[I->b].native;
+    regs[I->a] = Fn(regs[I->c]);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CALLNATIVE2): {
+    if (BytecodeFunctions[I->b].defined)
+      goto call_bytecode;
+    auto *Fn = (double (*)(double, double))BytecodeFunctions[I->b].native;
+    regs[I->a] = Fn(regs[I->c], regs[I->c + 1]);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CALLNATIVE3): {
+    if (BytecodeFunctions[I->b].defined)
+      goto call_bytecode;
+    auto *Fn = (double (*)(double, double, double))BytecodeFunctions[I->b].native;
+    regs[I->a] = Fn(regs[I->c], regs[I->c + 1], regs[I->c + 2]);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_RET):
+    result = regs[I->a];
+    return true;
+
+#ifndef TYLANG_THREADED_DISPATCH
+  }
+#endif
+#undef VM_CASE
+#undef VM_DISPATCH
+}
+
+// Call a compiled function with the given arguments.
+static bool runBytecode(const BytecodeFunction &F, const std::vector<double> &argVals, double &result) {
+  if (!VMStack)
+    VMStack = std::make_unique<double[]>(VMStackSize);
+
+  std::copy(argVals.begin(), argVals.end(), VMStack.get());
+  return executeBytecode(F, VMStack.get(), result);
+}
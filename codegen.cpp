@@ -1,28 +1,135 @@
 #include "ast.h"
 
-static llvm::LLVMContext TheContext;
-static llvm::IRBuilder<> Builder(TheContext);
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-static std::map<std::string, llvm::Value *> NamedValues;
-static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+// Everything needed to lower ASTs to IR. Each thread that generates code owns
+// one, so independent functions can be lowered and optimized in parallel.
+// Modules must stay alive no longer than the CodeGen that created them.
+struct CodeGen {
+  CodeGen(const llvm::DataLayout &DL, bool BindDirectCalls)
+      : Context(std::make_unique<llvm::LLVMContext>()), Builder(*Context), DL(DL), BindDirectCalls(BindDirectCalls) {
+    newModule();
+  }
+
+  std::unique_ptr<llvm::LLVMContext> Context;
+  llvm::IRBuilder<> Builder;
+  std::unique_ptr<llvm::Module> Module;
+  std::unique_ptr<llvm::legacy::FunctionPassManager> FPM;
+  std::map<std::string, llvm::Value *> NamedValues;
+  llvm::DataLayout DL;
+  // Whether calls may be bound to addresses from the JIT. Only code
+  // generators used with the JIT locked can ask it.
+  bool BindDirectCalls;
+
+  // Start a new module with its own pass manager.
+  void newModule();
+
+  // Hand over the current module and start a new one.
+  std::unique_ptr<llvm::Module> takeModule() {
+    ModulesTaken++;
+    auto M = std::move(Module);
+    newModule();
+    return M;
+  }
+
+  unsigned ModulesTaken = 0;
+};
+
+// Modules a code generator hands over before recycleCodeGen gives it a fresh
+// context. 0 keeps each context for good.
+static unsigned ContextRecycleInterval = 256;
+
+// When set, calls to functions the JIT has already compiled are emitted as
+// calls to their absolute address instead of going through symbol resolution.
+static bool DirectCalls = false;
+
+static void addFunctionProto(const PrototypeAST &P) {
+  std::lock_guard<std::mutex> Lock(TheSession->FunctionProtosMutex);
+  TheSession->FunctionProtos[P.getName()] = std::make_unique<PrototypeAST>(P);
+}
+
+// Returns a copy of the prototype for name, or null if there is none.
+static std::unique_ptr<PrototypeAST> findFunctionProto(const std::string &name) {
+  std::lock_guard<std::mutex> Lock(TheSession->FunctionProtosMutex);
+  auto FI = TheSession->FunctionProtos.find(name);
+  if (FI == TheSession->FunctionProtos.end())
+    return nullptr;
+  return std::make_unique<PrototypeAST>(*FI->second);
+}
+
+// Returns a copy of every prototype, in name order.
+static std::vector<std::unique_ptr<PrototypeAST>> getFunctionProtos() {
+  std::lock_guard<std::mutex> Lock(TheSession->FunctionProtosMutex);
+  std::vector<std::unique_ptr<PrototypeAST>> Protos;
+  for (auto &P : TheSession->FunctionProtos)
+    Protos.push_back(std::make_unique<PrototypeAST>(*P.second));
+  return Protos;
+}
+
+// Replace CG with a fresh code generator once it has handed over
+// ContextRecycleInterval modules. The JIT compiles a module as soon as it gets
+// it and then frees it, but the constants, types and metadata the module's
+// context uniqued for it stay until the context goes. Only call this when no
+// module CG created is still alive. Its current module may hold declarations,
+// which are recreated from FunctionProtos on demand.
+static void recycleCodeGen(std::unique_ptr<CodeGen> &CG) {
+  if (!ContextRecycleInterval || CG->ModulesTaken < ContextRecycleInterval)
+    return;
+  CG = std::make_unique<CodeGen>(CG->DL, CG->BindDirectCalls);
+}
+
+void CodeGen::newModule() {
+  // Open a new module
+  Module = std::make_unique<llvm::Module>("JIFF", *Context);
+  Module->setDataLayout(DL);
+
+  // Create a new pass manager attached to it
+  FPM = std::make_unique<llvm::legacy::FunctionPassManager>(Module.get());
+
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  FPM->add(llvm::createInstructionCombiningPass());
+  // Reassociate expressions.
+  FPM->add(llvm::createReassociatePass());
+  // Eliminate Common SubExpressions.
+  FPM->add(llvm::createGVNPass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  FPM->add(llvm::createCFGSimplificationPass());
+
+  FPM->doInitialization();
+}
 
 // Helpers
+
+// When set, errors logged on this thread are also collected here, for a
+// daemon client whose request caused them.
+static thread_local std::vector<std::string> *CollectedErrors = nullptr;
+
+static void logError(const char *Str) {
+  if (!TheSession || TheSession->Echo)
+    fprintf(stderr, "LogError: %s\n", Str);
+  if (CollectedErrors)
+    CollectedErrors->push_back(Str);
+}
+
+// Print the IR of a function just generated, if the session echoes.
+static void echoIR(llvm::Function *F) {
+  if (!TheSession->Echo)
+    return;
+  F->print(llvm::errs());
+  fprintf(stderr, "\n");
+}
+
 llvm::Value *LogErrorV(const char *Str) {
-  LogErrorV(Str);
+  logError(Str);
   return nullptr;
 }
 
-llvm::Function *getFunction(std::string funcName) {
+llvm::Function *getFunction(CodeGen &CG, std::string funcName) {
   // first check to see if we already have the module
-  if (auto *F = TheModule->getFunction(funcName))
+  if (auto *F = CG.Module->getFunction(funcName))
     return F;
 
   // If not, check where we can codegen the declaration for some existing proto
-  auto FI = FunctionProtos.find(funcName);
-  if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+  if (auto P = findFunctionProto(funcName))
+    return P->codegen(CG);
 
   // if no existing prototype
   return nullptr;
@@ -30,22 +137,22 @@ llvm::Function *getFunction(std::string funcName) {
 
 // codegen
 
-llvm::Value *NumberExprAST::codegen() {
-  return llvm::ConstantFP::get(TheContext, llvm::APFloat(val));
+llvm::Value *NumberExprAST::codegen(CodeGen &CG) {
+  return llvm::ConstantFP::get(*CG.Context, llvm::APFloat(val));
 }
 
-llvm::Value *VariableExprAST::codegen() {
+llvm::Value *VariableExprAST::codegen(CodeGen &CG) {
   // Look this variable up in function
-  llvm::Value *V = NamedValues[name];
+  llvm::Value *V = CG.NamedValues[name];
   if (!V) {
     LogErrorV("Unknown variable name");
   }
   return V;
 }
 
-llvm::Value *BinaryExprAST::codegen() {
-  llvm::Value *L = LHS->codegen();
-  llvm::Value *R = RHS->codegen();
+llvm::Value *BinaryExprAST::codegen(CodeGen &CG) {
+  llvm::Value *L = LHS->codegen(CG);
+  llvm::Value *R = RHS->codegen(CG);
   if (!L || !R) {
     return nullptr;
   }
@@ -53,30 +160,31 @@ llvm::Value *BinaryExprAST::codegen() {
   switch (op)
   {
   case '+':
-    return Builder.CreateFAdd(L, R, "addtmp");
+    return CG.Builder.CreateFAdd(L, R, "addtmp");
     break;
   case '-':
-    return Builder.CreateFSub(L, R, "subtmp");
+    return CG.Builder.CreateFSub(L, R, "subtmp");
     break;
   case '*':
-    return Builder.CreateFMul(L, R, "multmp");
+    return CG.Builder.CreateFMul(L, R, "multmp");
     break;
   case '<':
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
+    L = CG.Builder.CreateFCmpULT(L, R, "cmptmp");
     // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext), "booltmp");
+    return CG.Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(*CG.Context), "booltmp");
   default:
     return LogErrorV("invalid binary operator");
   }
 }
 
-llvm::Function *PrototypeAST::codegen() {
+llvm::Function *PrototypeAST::codegen(CodeGen &CG) {
   // Make the function type: double(double, double) etc.
 
-  std::vector<llvm::Type*> Doubles(args.size(), llvm::Type::getDoubleTy(TheContext));
+  std::vector<llvm::Type*> Doubles(args.size(), llvm::Type::getDoubleTy(*CG.Context));
 
-  llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(TheContext), Doubles, false);
-  llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, TheModule.get());
+  llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*CG.Context), Doubles, false);
+  llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, CG.Module.get());
+  F->setCallingConv(getCallingConv());
 
   // Set names for all arguments
   unsigned idx = 0;
@@ -87,9 +195,9 @@ llvm::Function *PrototypeAST::codegen() {
   return F;
 }
 
-llvm::Value *CallExprAST::codegen() {
+llvm::Value *CallExprAST::codegen(CodeGen &CG) {
   // Look up the name in the global module table
-  llvm::Function *CalleeF = getFunction(callee);
+  llvm::Function *CalleeF = getFunction(CG, callee);
   if (!CalleeF)
     return LogErrorV("Unknown function referenced");
 
@@ -99,43 +207,61 @@ llvm::Value *CallExprAST::codegen() {
 
   std::vector<llvm::Value *> ArgsV;
   for (unsigned i = 0, e = args.size(); i != e; ++i) {
-      ArgsV.push_back(args[i]->codegen());
+      ArgsV.push_back(args[i]->codegen(CG));
       if (!ArgsV.back())
         return nullptr;
   }
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltemp");
+  // Bind straight to the callee's address when it already lives in the JIT.
+  llvm::Value *CalleeV = CalleeF;
+  if (DirectCalls && CG.BindDirectCalls && CalleeF->isDeclaration()) {
+    if (auto Addr = TheSession->JIT->getSymbolAddress(callee)) {
+      auto *AddrV = llvm::ConstantInt::get(llvm::Type::getInt64Ty(*CG.Context), Addr);
+      CalleeV = llvm::ConstantExpr::getIntToPtr(AddrV, CalleeF->getType());
+      // The object won't refer to callee, so tell the JIT this module uses
+      // it. Otherwise the code at Addr could be freed once it's redefined.
+      CG.Module->getOrInsertNamedMetadata(llvm::orc::KaleidoscopeJIT::DirectCalleesMetadata)
+          ->addOperand(llvm::MDNode::get(*CG.Context, llvm::MDString::get(*CG.Context, callee)));
+    }
+  }
+
+  llvm::CallInst *Call = CG.Builder.CreateCall(CalleeF->getFunctionType(), CalleeV, ArgsV, "calltemp");
+  Call->setCallingConv(CalleeF->getCallingConv());
+  return Call;
 }
 
 
-llvm::Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
+llvm::Function *FunctionAST::codegen(CodeGen &CG) {
+  // Whoever parsed the definition recorded its prototype for other modules.
+  // By now that may be a newer definition's, so declare it from the AST's
+  // own unless this module already has it.
   auto &P = *proto;
-  FunctionProtos[proto->getName()] = std::move(proto);
-  llvm::Function *theFunction = getFunction(P.getName());
+  llvm::Function *theFunction = CG.Module->getFunction(P.getName());
   if (!theFunction)
-    return nullptr;
+    theFunction = P.codegen(CG);
+
+  // An earlier extern may have declared this name with the C convention.
+  theFunction->setCallingConv(P.getCallingConv());
 
   // Create a new basic block to start insertion into.
-  llvm::BasicBlock *BB = llvm::BasicBlock::Create(TheContext, "entry", theFunction);
-  Builder.SetInsertPoint(BB);
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CG.Context, "entry", theFunction);
+  CG.Builder.SetInsertPoint(BB);
 
   // Record the function arguments in the Named Values map.
-  NamedValues.clear();
+  CG.NamedValues.clear();
   for (auto &arg : theFunction->args())
-    NamedValues[arg.getName()] = &arg;
+    CG.NamedValues[arg.getName()] = &arg;
 
-  llvm::Value *RetVal = body->codegen();
+  llvm::Value *RetVal = body->codegen(CG);
 
   if (RetVal) {
     // finish off the function
-    Builder.CreateRet(RetVal);
+    CG.Builder.CreateRet(RetVal);
 
     //validate the generated code, checking for consistency.
     llvm::verifyFunction(*theFunction);
 
-    TheFPM->run(*theFunction);
+    CG.FPM->run(*theFunction);
 
     return theFunction;
   }
@@ -143,4 +269,91 @@ llvm::Function *FunctionAST::codegen() {
   // error reading body,
   theFunction->eraseFromParent();
   return nullptr;
+}
+
+// Emit name(i8 *fn, double *args), a C ABI function that calls fn, a
+// function of numArgs doubles with calling convention CC, on args[0..numArgs).
+// This lets C++ call any function of that shape given just its address.
+llvm::Function *codegenTrampoline(CodeGen &CG, unsigned numArgs, llvm::CallingConv::ID CC, const std::string &name) {
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*CG.Context);
+  std::vector<llvm::Type*> Doubles(numArgs, DoubleTy);
+  llvm::FunctionType *CalleeTy = llvm::FunctionType::get(DoubleTy, Doubles, false);
+  llvm::Type *Params[] = {llvm::Type::getInt8PtrTy(*CG.Context), DoubleTy->getPointerTo()};
+  llvm::FunctionType *FT = llvm::FunctionType::get(DoubleTy, Params, false);
+  llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, name, CG.Module.get());
+
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CG.Context, "entry", F);
+  CG.Builder.SetInsertPoint(BB);
+
+  auto AI = F->arg_begin();
+  llvm::Value *Fn = &*AI++;
+  llvm::Value *Args = &*AI;
+  std::vector<llvm::Value *> ArgsV;
+  for (unsigned i = 0; i != numArgs; ++i) {
+    llvm::Value *ArgPtr = CG.Builder.CreateConstInBoundsGEP1_32(DoubleTy, Args, i);
+    ArgsV.push_back(CG.Builder.CreateLoad(DoubleTy, ArgPtr, "arg"));
+  }
+  llvm::Value *Callee = CG.Builder.CreateBitCast(Fn, CalleeTy->getPointerTo());
+  llvm::CallInst *Call = CG.Builder.CreateCall(CalleeTy, Callee, ArgsV, "calltemp");
+  Call->setCallingConv(CC);
+  CG.Builder.CreateRet(Call);
+
+  llvm::verifyFunction(*F);
+  return F;
+}
+
+// Run the standard module pipeline at OptLevel, including inlining.
+static void optimizeModule(llvm::Module &M, unsigned OptLevel) {
+  llvm::PassManagerBuilder PMB;
+  PMB.OptLevel = OptLevel;
+  PMB.Inliner = llvm::createFunctionInliningPass(OptLevel, 0, false);
+
+  llvm::legacy::PassManager MPM;
+  PMB.populateModulePassManager(MPM);
+  MPM.run(M);
+}
+
+// Emit entryName, a C ABI function that forwards to the function described by
+// P. This lets C++ call .ty functions whatever their calling convention.
+llvm::Function *codegenCEntry(CodeGen &CG, const PrototypeAST &P, const std::string &entryName) {
+  llvm::Function *Callee = getFunction(CG, P.getName());
+  if (!Callee)
+    return nullptr;
+
+  std::vector<llvm::Type*> Doubles(P.getArgs().size(), llvm::Type::getDoubleTy(*CG.Context));
+  llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*CG.Context), Doubles, false);
+  llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, entryName, CG.Module.get());
+
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CG.Context, "entry", F);
+  CG.Builder.SetInsertPoint(BB);
+
+  std::vector<llvm::Value *> ArgsV;
+  for (auto &arg : F->args())
+    ArgsV.push_back(&arg);
+  llvm::CallInst *Call = CG.Builder.CreateCall(Callee, ArgsV, "calltemp");
+  Call->setCallingConv(Callee->getCallingConv());
+  CG.Builder.CreateRet(Call);
+
+  llvm::verifyFunction(*F);
+  return F;
+}
+
+// Compile M to an in-memory object file. Lets a thread produce machine code
+// without going through the JIT. Goes through the object cache like the JIT.
+static std::unique_ptr<llvm::MemoryBuffer> emitObject(llvm::TargetMachine &TM, llvm::Module &M) {
+  if (TheSession->ObjectCache)
+    if (auto Obj = TheSession->ObjectCache->getObject(&M))
+      return Obj;
+
+  llvm::SmallVector<char, 0> ObjBuffer;
+  llvm::raw_svector_ostream ObjStream(ObjBuffer);
+  llvm::legacy::PassManager PM;
+  llvm::MCContext *Ctx;
+  if (TM.addPassesToEmitMC(PM, Ctx, ObjStream))
+    return nullptr;
+  PM.run(M);
+  auto Obj = std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(ObjBuffer));
+  if (TheSession->ObjectCache)
+    TheSession->ObjectCache->notifyObjectCompiled(&M, Obj->getMemBufferRef());
+  return Obj;
 }
\ No newline at end of file
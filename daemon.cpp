@@ -0,0 +1,247 @@
+#include "ast.h"
+#include <poll.h>
+#include <shared_mutex>
+#include <sys/time.h>
+
+// Daemon mode. --daemon=SOCKET keeps one JIT session, and everything it has
+// compiled, for as long as it runs, and serves requests against it from any
+// number of clients on a UNIX socket. The thread that accepts connections
+// also polls the idle ones, and hands each request that arrives to a pool of
+// --daemon-threads threads, so idle clients hold no thread. A client that
+// starts a request has DaemonIOTimeout to send the rest of it, and to take
+// the response, or it is disconnected. All integers and doubles are in the
+// host's byte order:
+//
+//   request:  uint8_t op, uint32_t length, <length bytes>
+//     op 1, run:  source text: definitions, externs, imports and top-level
+//                 expressions, as in a file
+//     op 2, call: a function's name, NUL, then its arguments as doubles
+//   response: uint8_t status, uint32_t length, <length bytes>
+//     status 0:   the value of every top-level expression, or of the call,
+//                 as doubles
+//     status 1:   error messages, one per line
+//
+// Runs parse and compile with the parser and MainCodeGen, so they take turns.
+// With --jobs, a run waits for the workers to finish its definitions, and
+// returns their errors with its own.
+// Calls only look a function up, and run alongside each other.
+
+enum DaemonOp : uint8_t { DaemonRun = 1, DaemonCall = 2 };
+enum DaemonStatus : uint8_t { DaemonOK = 0, DaemonError = 1 };
+
+static std::string DaemonSocketPath;
+static unsigned DaemonThreads = std::max(1u, std::thread::hardware_concurrency());
+static const uint32_t MaxDaemonRequest = 16 << 20;
+static const int DaemonIOTimeout = 10; // seconds
+
+// Held exclusively by runs, and shared by calls.
+static std::shared_timed_mutex DaemonMutex;
+
+// Runs a request's source through the parser, set by main.
+static std::function<void(FILE *)> DaemonRunSource;
+
+// Connections with a request to read, waiting for a worker.
+static std::deque<int> DaemonConnections;
+// Connections a worker has answered, for the polling thread to watch again.
+static std::vector<int> DaemonIdleConnections;
+static std::mutex DaemonConnectionsMutex;
+static std::condition_variable DaemonCV;
+// Written to wake the polling thread when a connection comes back.
+static int DaemonWakeFD = -1;
+
+static bool readAll(int FD, void *Buf, size_t Size) {
+  return recv(FD, Buf, Size, MSG_WAITALL) == (ssize_t)Size;
+}
+
+static bool writeAll(int FD, const void *Buf, size_t Size) {
+  return send(FD, Buf, Size, MSG_NOSIGNAL) == (ssize_t)Size;
+}
+
+// Run Source in the session, collecting the value of each top-level
+// expression and every error.
+static void runDaemonSource(const std::string &Source, std::vector<double> &Results, std::vector<std::string> &Errors) {
+  if (Source.empty())
+    return;
+  FILE *F = fmemopen((void *)Source.data(), Source.size(), "r");
+  if (!F) {
+    Errors.push_back("Could not read the request");
+    return;
+  }
+
+  std::unique_lock<std::shared_timed_mutex> Lock(DaemonMutex);
+  CollectedResults = &Results;
+  CollectedErrors = &Errors;
+  DaemonRunSource(F);
+  CollectedResults = nullptr;
+  CollectedErrors = nullptr;
+  fclose(F);
+}
+
+// Call the function named at the start of Request with the arguments after
+// it.
+static void callDaemonFunction(const std::string &Request, std::vector<double> &Results,
+                               std::vector<std::string> &Errors) {
+  size_t NameEnd = Request.find('\0');
+  if (NameEnd == std::string::npos || (Request.size() - NameEnd - 1) % sizeof(double)) {
+    Errors.push_back("Malformed call");
+    return;
+  }
+  std::string Name = Request.substr(0, NameEnd);
+  std::vector<double> Args((Request.size() - NameEnd - 1) / sizeof(double));
+  memcpy(Args.data(), Request.data() + NameEnd + 1, Args.size() * sizeof(double));
+
+  std::shared_lock<std::shared_timed_mutex> Lock(DaemonMutex);
+  auto P = findFunctionProto(Name);
+  if (!P) {
+    Errors.push_back("Unknown function " + Name);
+    return;
+  }
+  if (P->getArgs().size() != Args.size()) {
+    Errors.push_back(Name + " takes " + std::to_string(P->getArgs().size()) + " arguments");
+    return;
+  }
+
+  std::unique_lock<std::mutex> JITLock(TheSession->JITMutex);
+  void *Addr = (void *)TheSession->JIT->getSymbolAddress(Name);
+  Trampoline T = Addr ? getTrampoline(Args.size(), P->getCallingConv()) : nullptr;
+  JITLock.unlock();
+  if (!T) {
+    Errors.push_back("Could not find " + Name);
+    return;
+  }
+
+  EpochGuard Guard;
+  Results.push_back(T(Addr, Args.data()));
+}
+
+// Answer the request waiting on Conn. Returns false if the client hung up or
+// broke the protocol.
+static bool serveDaemonRequest(int Conn) {
+  uint8_t Op;
+  uint32_t Length;
+  if (!readAll(Conn, &Op, sizeof(Op)) || !readAll(Conn, &Length, sizeof(Length)) || Length > MaxDaemonRequest)
+    return false;
+  std::string Request(Length, '\0');
+  if (Length && !readAll(Conn, &Request[0], Length))
+    return false;
+
+  std::vector<double> Results;
+  std::vector<std::string> Errors;
+  if (Op == DaemonRun)
+    runDaemonSource(Request, Results, Errors);
+  else if (Op == DaemonCall)
+    callDaemonFunction(Request, Results, Errors);
+  else
+    Errors.push_back("Unknown request " + std::to_string(Op));
+
+  std::string Response;
+  uint8_t Status = Errors.empty() ? DaemonOK : DaemonError;
+  if (Errors.empty())
+    Response.assign((const char *)Results.data(), Results.size() * sizeof(double));
+  for (auto &E : Errors)
+    Response += E + "\n";
+  Length = Response.size();
+  return writeAll(Conn, &Status, sizeof(Status)) && writeAll(Conn, &Length, sizeof(Length)) &&
+         writeAll(Conn, Response.data(), Response.size());
+}
+
+static void daemonWorker(Session *S) {
+  SessionScope Scope(S);
+  while (true) {
+    int Conn;
+    {
+      std::unique_lock<std::mutex> Lock(DaemonConnectionsMutex);
+      DaemonCV.wait(Lock, [] { return !DaemonConnections.empty(); });
+      Conn = DaemonConnections.front();
+      DaemonConnections.pop_front();
+    }
+    if (!serveDaemonRequest(Conn)) {
+      close(Conn);
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> Lock(DaemonConnectionsMutex);
+      DaemonIdleConnections.push_back(Conn);
+    }
+    char Wake = 0;
+    (void)!write(DaemonWakeFD, &Wake, 1);
+  }
+}
+
+// Serve clients on Path, running their source with RunSource. Only returns
+// if it can't listen. If accepting connections fails, exits the process.
+static int runDaemon(const std::string &Path, std::function<void(FILE *)> RunSource) {
+  int Listener = listenOnUnixSocket(Path);
+  if (Listener < 0)
+    return 1;
+
+  int Wake[2];
+  if (pipe2(Wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+    fprintf(stderr, "pipe: %s\n", strerror(errno));
+    close(Listener);
+    return 1;
+  }
+  DaemonWakeFD = Wake[1];
+
+  DaemonRunSource = std::move(RunSource);
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0; i != DaemonThreads; ++i)
+    Workers.emplace_back(daemonWorker, TheSession);
+  fprintf(stderr, "Daemon listening on %s with %u threads\n", Path.c_str(), DaemonThreads);
+
+  // Connections waiting for their next request. Only this thread has them.
+  std::vector<int> Idle;
+  while (true) {
+    std::vector<pollfd> FDs{{Listener, POLLIN, 0}, {Wake[0], POLLIN, 0}};
+    for (int Conn : Idle)
+      FDs.push_back({Conn, POLLIN, 0});
+    if (poll(FDs.data(), FDs.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      break;
+    }
+
+    // A client that hung up is readable too, and the worker finds out.
+    std::vector<int> Ready;
+    Idle.clear();
+    for (size_t i = 2; i != FDs.size(); ++i)
+      (FDs[i].revents ? Ready : Idle).push_back(FDs[i].fd);
+    if (!Ready.empty()) {
+      {
+        std::lock_guard<std::mutex> Lock(DaemonConnectionsMutex);
+        DaemonConnections.insert(DaemonConnections.end(), Ready.begin(), Ready.end());
+      }
+      DaemonCV.notify_all();
+    }
+
+    if (FDs[1].revents) {
+      char Buf[64];
+      while (read(Wake[0], Buf, sizeof(Buf)) > 0)
+        ;
+      std::lock_guard<std::mutex> Lock(DaemonConnectionsMutex);
+      Idle.insert(Idle.end(), DaemonIdleConnections.begin(), DaemonIdleConnections.end());
+      DaemonIdleConnections.clear();
+    }
+
+    if (FDs[0].revents) {
+      int Conn = accept4(Listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (Conn < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+          continue;
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        break;
+      }
+      timeval Timeout{DaemonIOTimeout, 0};
+      setsockopt(Conn, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+      setsockopt(Conn, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+      Idle.push_back(Conn);
+    }
+  }
+
+  // The workers may be partway through a request on the session. Exit
+  // without unwinding, which would destroy it under them.
+  close(Listener);
+  fflush(stdout);
+  _exit(1);
+}
@@ -0,0 +1,116 @@
+#include "ast.h"
+
+// The call graph between definitions. The parallel driver uses it to find
+// which compiled functions a redefinition makes stale, and to split the
+// functions it recompiles into strongly connected components that can be
+// compiled in waves: every component only calls components from earlier
+// waves, so the components within a wave are independent of each other.
+
+// A strongly connected component of the call graph, compiled as one module.
+struct CompileUnit {
+  std::vector<std::shared_ptr<FunctionAST>> Functions;
+  unsigned Wave = 0;
+  // Indices of the units this one calls.
+  std::vector<unsigned> Deps;
+};
+
+static bool isDefinedInCallGraph(const std::string &Name) {
+  auto NI = TheSession->CallGraph.find(Name);
+  return NI != TheSession->CallGraph.end() && NI->second.Fn;
+}
+
+// Make Fn the definition of its name, replacing the edges of any earlier one.
+static void addToCallGraph(std::shared_ptr<FunctionAST> Fn) {
+  const std::string &Name = Fn->getName();
+  CallGraphNode &Node = TheSession->CallGraph[Name];
+  for (auto &Callee : Node.Callees)
+    TheSession->CallGraph[Callee].Callers.erase(Name);
+
+  std::vector<std::string> Callees;
+  Fn->getCallees(Callees);
+  Node.Fn = Fn;
+  Node.Callees = std::set<std::string>(Callees.begin(), Callees.end());
+  for (auto &Callee : Node.Callees)
+    TheSession->CallGraph[Callee].Callers.insert(Name);
+}
+
+// Add every definition that calls Name, directly or not, to Stale.
+static void addStaleCallers(const std::string &Name, std::set<std::string> &Stale) {
+  std::vector<std::string> Work{Name};
+  while (!Work.empty()) {
+    auto NI = TheSession->CallGraph.find(Work.back());
+    Work.pop_back();
+    if (NI == TheSession->CallGraph.end())
+      continue;
+    for (auto &Caller : NI->second.Callers)
+      if (isDefinedInCallGraph(Caller) && Stale.insert(Caller).second)
+        Work.push_back(Caller);
+  }
+}
+
+// Tarjan's algorithm over the subgraph induced by Names. Components come out
+// callees first, which is the order they have to be compiled in.
+struct SCCFinder {
+  const std::set<std::string> &Names;
+  std::map<std::string, unsigned> Index, LowLink;
+  std::vector<std::string> Stack;
+  std::set<std::string> OnStack;
+  std::map<std::string, unsigned> UnitOf;
+  std::vector<CompileUnit> Units;
+
+  SCCFinder(const std::set<std::string> &Names) : Names(Names) {}
+
+  void visit(const std::string &Name) {
+    unsigned I = Index.size();
+    Index[Name] = LowLink[Name] = I;
+    Stack.push_back(Name);
+    OnStack.insert(Name);
+
+    for (auto &Callee : TheSession->CallGraph[Name].Callees) {
+      if (!Names.count(Callee))
+        continue;
+      if (!Index.count(Callee)) {
+        visit(Callee);
+        LowLink[Name] = std::min(LowLink[Name], LowLink[Callee]);
+      } else if (OnStack.count(Callee)) {
+        LowLink[Name] = std::min(LowLink[Name], Index[Callee]);
+      }
+    }
+
+    if (LowLink[Name] != Index[Name])
+      return;
+
+    unsigned U = Units.size();
+    Units.emplace_back();
+    std::string Member;
+    do {
+      Member = Stack.back();
+      Stack.pop_back();
+      OnStack.erase(Member);
+      UnitOf[Member] = U;
+      Units[U].Functions.push_back(TheSession->CallGraph[Member].Fn);
+    } while (Member != Name);
+
+    // Everything this component calls outside itself is already in a unit.
+    std::set<unsigned> Deps;
+    for (auto &Fn : Units[U].Functions)
+      for (auto &Callee : TheSession->CallGraph[Fn->getName()].Callees) {
+        auto UI = UnitOf.find(Callee);
+        if (UI != UnitOf.end() && UI->second != U)
+          Deps.insert(UI->second);
+      }
+    for (unsigned D : Deps) {
+      Units[U].Deps.push_back(D);
+      Units[U].Wave = std::max(Units[U].Wave, Units[D].Wave + 1);
+    }
+  }
+};
+
+// Split the definitions in Names into compile units, callees first.
+static std::vector<CompileUnit> planCompileUnits(const std::set<std::string> &Names) {
+  SCCFinder Finder(Names);
+  for (auto &Name : Names)
+    if (!Finder.Index.count(Name))
+      Finder.visit(Name);
+  return std::move(Finder.Units);
+}
@@ -0,0 +1,57 @@
+#include "ast.h"
+
+// Hot-swappable definitions (--hot-swap). Every definition is compiled as
+// name$impl and called through a JIT stub for name, an indirect jump through
+// a pointer. Redefining a function compiles the new body and repoints the
+// stub, so every caller, compiled before or after, switches to it with a
+// single pointer store. Nothing links against name$impl, so the module with
+// the old body is superseded as soon as the new one is added, and reclaimed
+// once no thread can still be running it.
+
+// Names that already have a stub.
+static std::set<std::string> HotSwapStubs;
+
+// Rename F to ImplName, leaving a declaration under its old name so every
+// call, recursive ones included, goes through the stub.
+static void moveBodyToImpl(llvm::Function *F, const std::string &ImplName) {
+  std::string Name = F->getName().str();
+  F->setName(ImplName);
+  auto *Decl = llvm::Function::Create(F->getFunctionType(), llvm::Function::ExternalLinkage, Name, F->getParent());
+  Decl->setCallingConv(F->getCallingConv());
+  F->replaceAllUsesWith(Decl);
+}
+
+// Compile Fn and point its stub at it. If compilation fails the previous
+// definition stays in place. Caller holds JITMutex.
+static void addHotSwapDefinition(FunctionAST &Fn) {
+  const std::string &Name = Fn.getName();
+  std::string ImplName = Name + "$impl";
+  auto *FnIR = Fn.codegen(*TheSession->MainCodeGen);
+  if (!FnIR)
+    return;
+  echoIR(FnIR);
+  moveBodyToImpl(FnIR, ImplName);
+
+  // The new body may call itself through the stub, so the stub has to exist
+  // before it is linked.
+  if (HotSwapStubs.insert(Name).second)
+    cantFail(TheSession->JIT->updateStub(Name, (llvm::JITTargetAddress)(intptr_t)LazyCompileFailed));
+
+  auto K = TheSession->JIT->addModule(TheSession->MainCodeGen->takeModule());
+  llvm::JITTargetAddress Addr = TheSession->JIT->getSymbolAddress(ImplName);
+  if (!Addr) {
+    fprintf(stderr, "Could not compile %s\n", Name.c_str());
+    TheSession->JIT->removeModule(K);
+    return;
+  }
+
+  // An aligned pointer store: a thread calling through the stub right now
+  // jumps to either the old body or the new one.
+  if (auto Err = TheSession->JIT->updateStub(Name, Addr)) {
+    llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Could not update stub: ");
+    TheSession->JIT->removeModule(K);
+    return;
+  }
+  recycleCodeGen(TheSession->MainCodeGen);
+  reclaimModules();
+}
@@ -0,0 +1,139 @@
+#include "ast.h"
+
+// A tree-walking evaluator for the AST. For short scripts compiling a
+// function costs far more than running it, so this path skips IR generation
+// and the JIT entirely.
+
+// Definitions registered for interpretation, by name.
+static std::map<std::string, std::shared_ptr<FunctionAST>> FunctionDefs;
+// Host process addresses of externs, looked up once.
+static std::map<std::string, void *> NativeSymbols;
+
+bool LogErrorI(const char *Str) {
+  logError(Str);
+  return false;
+}
+
+// Most arguments callNative can pass.
+static const unsigned MaxNativeCallArgs = 6;
+
+// Call a native function that takes numArgs doubles and returns a double
+// using the C calling convention.
+static bool callNative(void *addr, const double *a, unsigned numArgs, double &result) {
+  using D = double;
+  switch (numArgs) {
+  case 0:
+    result = ((D (*)())addr)();
+    return true;
+  case 1:
+    result = ((D (*)(D))addr)(a[0]);
+    return true;
+  case 2:
+    result = ((D (*)(D, D))addr)(a[0], a[1]);
+    return true;
+  case 3:
+    result = ((D (*)(D, D, D))addr)(a[0], a[1], a[2]);
+    return true;
+  case 4:
+    result = ((D (*)(D, D, D, D))addr)(a[0], a[1], a[2], a[3]);
+    return true;
+  case 5:
+    result = ((D (*)(D, D, D, D, D))addr)(a[0], a[1], a[2], a[3], a[4]);
+    return true;
+  case 6:
+    result = ((D (*)(D, D, D, D, D, D))addr)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    return true;
+  default:
+    return LogErrorI("Too many arguments for a native call");
+  }
+}
+
+static void *resolveNative(const std::string &name) {
+  auto I = NativeSymbols.find(name);
+  if (I != NativeSymbols.end())
+    return I->second;
+
+  void *addr = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name);
+  if (addr)
+    NativeSymbols[name] = addr;
+  return addr;
+}
+
+// Call a function by name: an interpreted definition if there is one,
+// otherwise an extern from the host process.
+static bool interpretCall(const std::string &name, const std::vector<double> &argVals, double &result) {
+  auto DI = FunctionDefs.find(name);
+  if (DI != FunctionDefs.end()) {
+    if (DI->second->getProto().getArgs().size() != argVals.size())
+      return LogErrorI("Incorrect number of arguments");
+    return DI->second->interpret(argVals, result);
+  }
+
+  auto P = findFunctionProto(name);
+  if (!P)
+    return LogErrorI("Unknown function referenced");
+  if (P->getArgs().size() != argVals.size())
+    return LogErrorI("Incorrect number of arguments");
+
+  void *addr = resolveNative(name);
+  if (!addr)
+    return LogErrorI("Unresolved extern");
+  return callNative(addr, argVals.data(), argVals.size(), result);
+}
+
+// interpret
+
+bool NumberExprAST::interpret(InterpFrame &frame, double &result) {
+  result = val;
+  return true;
+}
+
+bool VariableExprAST::interpret(InterpFrame &frame, double &result) {
+  auto V = frame.find(name);
+  if (V == frame.end())
+    return LogErrorI("Unknown variable name");
+  result = V->second;
+  return true;
+}
+
+bool BinaryExprAST::interpret(InterpFrame &frame, double &result) {
+  double L, R;
+  if (!LHS->interpret(frame, L) || !RHS->interpret(frame, R))
+    return false;
+
+  switch (op) {
+  case '+':
+    result = L + R;
+    return true;
+  case '-':
+    result = L - R;
+    return true;
+  case '*':
+    result = L * R;
+    return true;
+  case '<':
+    // Unordered or less than, matching the fcmp ult the JIT emits.
+    result = !(L >= R) ? 1.0 : 0.0;
+    return true;
+  default:
+    return LogErrorI("invalid binary operator");
+  }
+}
+
+bool CallExprAST::interpret(InterpFrame &frame, double &result) {
+  std::vector<double> argVals(args.size());
+  for (unsigned i = 0, e = args.size(); i != e; ++i)
+    if (!args[i]->interpret(frame, argVals[i]))
+      return false;
+
+  return interpretCall(callee, argVals, result);
+}
+
+bool FunctionAST::interpret(const std::vector<double> &argVals, double &result) {
+  InterpFrame frame;
+  auto &argNames = proto->getArgs();
+  for (unsigned i = 0, e = argNames.size(); i != e; ++i)
+    frame[argNames[i]] = argVals[i];
+
+  return body->interpret(frame, result);
+}
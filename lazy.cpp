@@ -0,0 +1,140 @@
+#include "ast.h"
+
+// Lazy compilation (--lazy) and speculation (--speculate).
+//
+// A lazy definition is registered behind a JIT stub and compiled by whichever
+// gets to it first: its first call, or the speculation worker. The worker
+// compiles the callees of code that has started running, on the bet that they
+// are about to be called, so the first call finds them ready.
+//
+// The session's JITMutex also covers LazyCodeGen.
+
+// Lazy functions get their own code generator, since a first call can arrive
+// while MainCodeGen is in the middle of a module.
+static std::unique_ptr<CodeGen> LazyCodeGen;
+
+struct LazyFunction {
+  std::shared_ptr<FunctionAST> Fn;
+  // Set once the function has been compiled.
+  llvm::JITTargetAddress Addr = 0;
+};
+
+// The current lazy definition of each name.
+static std::map<std::string, std::shared_ptr<LazyFunction>> LazyFunctions;
+
+static bool Speculating = false;
+static bool SpeculationShutdown = false;
+static std::condition_variable SpeculationCV;
+static std::deque<std::string> SpeculationQueue;
+static std::thread SpeculationWorker;
+
+// Stands in for a function whose lazy compilation failed. The result lands in
+// the same register whatever the caller's calling convention and arguments.
+static double LazyCompileFailed() {
+  return NAN;
+}
+
+// Queue the callees of Fn that are still uncompiled. Caller holds JITMutex.
+static void speculateCallees(const FunctionAST &Fn) {
+  if (!Speculating)
+    return;
+
+  std::vector<std::string> Callees;
+  Fn.getCallees(Callees);
+  for (auto &Name : Callees) {
+    auto LI = LazyFunctions.find(Name);
+    if (LI != LazyFunctions.end() && !LI->second->Addr)
+      SpeculationQueue.push_back(Name);
+  }
+  SpeculationCV.notify_one();
+}
+
+// Compile LF if nobody has yet and return its address. The stub keeps the
+// function's name, so the implementation is emitted as name$impl. Caller
+// holds JITMutex.
+static llvm::JITTargetAddress compileLazyFunction(LazyFunction &LF) {
+  if (LF.Addr)
+    return LF.Addr;
+
+  if (!LazyCodeGen)
+    LazyCodeGen = std::make_unique<CodeGen>(TheSession->JIT->getTargetMachine().createDataLayout(), true);
+
+  FunctionAST &Fn = *LF.Fn;
+  std::string ImplName = Fn.getName() + "$impl";
+  if (auto *FnIR = Fn.codegen(*LazyCodeGen)) {
+    FnIR->setName(ImplName);
+    TheSession->JIT->addModule(LazyCodeGen->takeModule());
+    recycleCodeGen(LazyCodeGen);
+    LF.Addr = TheSession->JIT->getSymbolAddress(ImplName);
+  } else {
+    LazyCodeGen->newModule();
+  }
+
+  if (!LF.Addr) {
+    fprintf(stderr, "Could not compile %s\n", Fn.getName().c_str());
+    LF.Addr = (llvm::JITTargetAddress)(intptr_t)LazyCompileFailed;
+    return LF.Addr;
+  }
+
+  speculateCallees(Fn);
+  return LF.Addr;
+}
+
+// Register a definition without generating any code for it yet. Caller holds
+// JITMutex.
+static void addLazyDefinition(std::shared_ptr<FunctionAST> Fn) {
+  auto LF = std::make_shared<LazyFunction>();
+  LF->Fn = Fn;
+  LazyFunctions[Fn->getName()] = LF;
+  addFunctionProto(Fn->getProto());
+
+  // The first call may come from any thread.
+  auto Compile = [LF, S = TheSession]() {
+    SessionScope Scope(S);
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    return compileLazyFunction(*LF);
+  };
+  if (auto Err = TheSession->JIT->addLazyFunction(Fn->getName(), Compile))
+    llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Could not add lazy definition: ");
+}
+
+static void speculationWorker(Session *S) {
+  SessionScope Scope(S);
+  std::unique_lock<std::mutex> Lock(TheSession->JITMutex);
+  while (1) {
+    SpeculationCV.wait(Lock, [] { return SpeculationShutdown || !SpeculationQueue.empty(); });
+    if (SpeculationShutdown)
+      return;
+
+    std::string Name = SpeculationQueue.front();
+    SpeculationQueue.pop_front();
+    auto LI = LazyFunctions.find(Name);
+    if (LI == LazyFunctions.end() || LI->second->Addr)
+      continue;
+
+    // Point the stub straight at the code so the first call skips the
+    // compile callback.
+    llvm::JITTargetAddress Addr = compileLazyFunction(*LI->second);
+    if (auto Err = TheSession->JIT->updateStub(Name, Addr))
+      llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Could not update stub: ");
+
+    // Give the main thread a chance at the JIT between functions.
+    Lock.unlock();
+    std::this_thread::yield();
+    Lock.lock();
+  }
+}
+
+static void startSpeculation() {
+  Speculating = true;
+  SpeculationWorker = std::thread(speculationWorker, TheSession);
+}
+
+static void stopSpeculation() {
+  {
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    SpeculationShutdown = true;
+  }
+  SpeculationCV.notify_one();
+  SpeculationWorker.join();
+}
@@ -6,8 +6,6 @@ int Lexer::getNextChar() {
 }
 
 int Lexer::gettok() {
-  static int LastChar = ' ';
-
   // Skip any whitespace
   while (isspace(LastChar))
     LastChar = getNextChar();
@@ -22,6 +20,8 @@ int Lexer::gettok() {
       return tok_def;
     if (IdentifierStr == "extern")
       return tok_extern;
+    if (IdentifierStr == "import")
+      return tok_import;
 
     return tok_identifier;
   }
@@ -6,6 +6,7 @@ enum Token {
   //commands
   tok_def = -2,
   tok_extern = -3,
+  tok_import = -6,
 
   // primary
   tok_identifier = -4,
@@ -26,9 +27,10 @@ private:
   std::string IdentifierStr;
   // holds data if token is tok_number
   double NumVal;
-  FILE * fp;
+  FILE * fp = nullptr;
 
-  int LastChar;
+  // The character after the current token, so each input starts afresh.
+  int LastChar = ' ';
   int CurTok;
 
   int getNextChar();
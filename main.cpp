@@ -10,30 +10,85 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cctype>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
-#include "KaleidoscopeJIT.h"
+#include <unistd.h>
+#include "session.h"
+#include "objcache.cpp"
 #include "codegen.cpp"
-
-#include "lexer/lexer.h"
-
-static Lexer lexer;
+#include "reclaim.cpp"
+#include "interpreter.cpp"
+#include "bytecode.cpp"
+#include "tiering.cpp"
+#include "lazy.cpp"
+#include "hotswap.cpp"
+#include "depgraph.cpp"
+#include "parallel.cpp"
+#include "toplevel.cpp"
+#include "modules.cpp"
+#include "prelude.cpp"
+#include "session.cpp"
+#include "aot.cpp"
+#include "zygote.cpp"
+#include "daemon.cpp"
+
+// How definitions and top-level expressions are executed.
+enum class Backend {
+  // Compile everything with the JIT, except top-level expressions that call
+  // nothing, which are cheaper to interpret.
+  JIT,
+  // Interpret everything. LLVM is never initialized.
+  Interp,
+  // Compile everything to bytecode for the VM. LLVM is never initialized.
+  VM,
+  // Start every function on the VM and recompile hot ones with the JIT in
+  // the background.
+  Tiered,
+};
+
+static Backend TheBackend = Backend::JIT;
+static unsigned TheTierUpThreshold = 1000;
+// Compile definitions on their first call instead of when they are parsed.
+static bool LazyDefinitions = false;
+// Compile the callees of running code in the background (implies lazy).
+static bool SpeculativeCompilation = false;
+// Call every definition through a stub that redefinition repoints.
+static bool HotSwap = false;
+// Directory of the persistent object cache, if any.
+static std::string ObjectCacheDir;
+// Print the JIT's memory and module statistics on exit.
+static bool PrintJITStatistics = false;
+// Threads that compile definitions in parallel. 1 compiles them inline.
+static unsigned TheJobs = 1;
 
 std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "LogError: %s\n" , Str);
+  logError(Str);
   return nullptr;
 }
 
@@ -48,24 +103,24 @@ static std::unique_ptr<ExprAST> ParseExpression();
 // numberexpr ::= number
 // called when the current token is a number
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(lexer.getNumberVal());
-  lexer.getNextToken();
+  auto result = std::make_unique<NumberExprAST>(TheSession->Lex.getNumberVal());
+  TheSession->Lex.getNextToken();
   return std::move(result);
 }
 
 // parenexpr ::= '(' expression ')'
 // called when the current token is a (
 static std::unique_ptr<ExprAST> ParseParenExpr() {
-  lexer.getNextToken(); // eat the '('
+  TheSession->Lex.getNextToken(); // eat the '('
 
   auto V = ParseExpression();
 
   if (!V) return nullptr;
 
-  if (lexer.getCurrentToken() != ')')
+  if (TheSession->Lex.getCurrentToken() != ')')
     return LogError("expected ')'");
 
-  lexer.getNextToken(); // eat ).
+  TheSession->Lex.getNextToken(); // eat ).
 
   return V;
 }
@@ -73,41 +128,41 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
 // ::= identifer
 // ::= identifer '(' expression ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string idName = lexer.getIdentifierStr();
+  std::string idName = TheSession->Lex.getIdentifierStr();
 
-  lexer.getNextToken(); // eat the identifier
+  TheSession->Lex.getNextToken(); // eat the identifier
 
-  if (lexer.getCurrentToken() != '(')
+  if (TheSession->Lex.getCurrentToken() != '(')
     return std::make_unique<VariableExprAST>(idName);
 
   // Call
-  lexer.getNextToken(); // eat (
+  TheSession->Lex.getNextToken(); // eat (
   std::vector<std::unique_ptr<ExprAST>> args;
-  if (lexer.getCurrentToken() != ')') {
+  if (TheSession->Lex.getCurrentToken() != ')') {
     while (1) {
       if (auto arg = ParseExpression())
         args.push_back(std::move(arg));
       else
         return nullptr;
 
-      if (lexer.getCurrentToken() == ')')
+      if (TheSession->Lex.getCurrentToken() == ')')
         break;
 
-      if (lexer.getCurrentToken() != ',')
+      if (TheSession->Lex.getCurrentToken() != ',')
         return LogError("Expected ')' or ',' in argument list");
 
-      lexer.getNextToken();
+      TheSession->Lex.getNextToken();
     }
   }
 
-  lexer.getNextToken(); // Eat the ')'
+  TheSession->Lex.getNextToken(); // Eat the ')'
 
   return std::make_unique<CallExprAST>(idName, std::move(args));
 }
 
 // Primary
 static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch(lexer.getCurrentToken()) {
+  switch(TheSession->Lex.getCurrentToken()) {
   default:
     return LogError("Unknown token when expecting an expression");
   case tok_identifier:
@@ -120,14 +175,12 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 }
 
 
-static std::map<char, int> BinopPrecedence;
-
 static int getTokenPrecedence() {
-  if (!isascii(lexer.getCurrentToken()))
+  if (!isascii(TheSession->Lex.getCurrentToken()))
     return -1;
 
   // Make sure it is in the bin op map
-  int prec = BinopPrecedence[lexer.getCurrentToken()];
+  int prec = TheSession->BinopPrecedence[TheSession->Lex.getCurrentToken()];
   if (prec <=0 ) return -1;
 
   return prec;
@@ -142,8 +195,8 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int exprPrec, std::unique_ptr<Expr
     if (tokPrec < exprPrec)
       return LHS;
 
-    int binOp = lexer.getCurrentToken();
-    lexer.getNextToken(); // eat binop
+    int binOp = TheSession->Lex.getCurrentToken();
+    TheSession->Lex.getNextToken(); // eat binop
 
     // Parse the primary expr after the binary operator
     auto RHS = ParsePrimary();
@@ -170,31 +223,31 @@ static std::unique_ptr<ExprAST> ParseExpression() {
   return ParseBinOpRHS(0, std::move(LHS));
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  if (lexer.getCurrentToken() != tok_identifier)
+static std::unique_ptr<PrototypeAST> ParsePrototype(bool external = false) {
+  if (TheSession->Lex.getCurrentToken() != tok_identifier)
     return LogErrorP("Expected function name in prototype");
 
-  std::string funcName = lexer.getIdentifierStr();
-  lexer.getNextToken();
+  std::string funcName = TheSession->Lex.getIdentifierStr();
+  TheSession->Lex.getNextToken();
 
-  if (lexer.getCurrentToken() != '(')
+  if (TheSession->Lex.getCurrentToken() != '(')
     return LogErrorP("Expected '(' in prototype but found");
 
   std::vector<std::string> argNames;
-  while (lexer.getNextToken() == tok_identifier)
-    argNames.push_back(lexer.getIdentifierStr());
+  while (TheSession->Lex.getNextToken() == tok_identifier)
+    argNames.push_back(TheSession->Lex.getIdentifierStr());
 
-  if (lexer.getCurrentToken() != ')')
+  if (TheSession->Lex.getCurrentToken() != ')')
     return LogErrorP("Expected ')' in prototype");
 
-  lexer.getNextToken(); // eat )
+  TheSession->Lex.getNextToken(); // eat )
 
-  return std::make_unique<PrototypeAST>(funcName, std::move(argNames));
+  return std::make_unique<PrototypeAST>(funcName, std::move(argNames), external);
 }
 
 
 static std::unique_ptr<FunctionAST> ParseDefinition() {
-  lexer.getNextToken(); // eat def
+  TheSession->Lex.getNextToken(); // eat def
   auto Proto = ParsePrototype();
   if (!Proto) return nullptr;
 
@@ -205,14 +258,14 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
 }
 
 static std::unique_ptr<PrototypeAST> ParseExtern() {
-  lexer.getNextToken(); // eat extern
-  return ParsePrototype();
+  TheSession->Lex.getNextToken(); // eat extern
+  return ParsePrototype(true);
 }
 
 static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
   if (auto E = ParseExpression()) {
-    // Make an anonymouse proto.
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+    // Make an anonymouse proto. It is called from C++, so it keeps the C ABI.
+    auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>(), true);
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
   }
   return nullptr;
@@ -220,107 +273,231 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 
 // Top-Level Parsing
 
+// Initialize the target and create the JIT. Starts no threads, so the
+// zygote can do it before forking.
+static void createJIT() {
+  // Embedders may create sessions on several threads at once.
+  static std::once_flag TargetInitialized;
+  std::call_once(TargetInitialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+
+  TheSession->ObjectCacheDir = ObjectCacheDir;
+  if (!ObjectCacheDir.empty())
+    TheSession->ObjectCache = std::make_unique<ObjectFileCache>(ObjectCacheDir);
+  TheSession->JIT = std::make_unique<llvm::orc::KaleidoscopeJIT>(TheSession->ObjectCache.get());
+  if (TheSession->ObjectCache)
+    TheSession->ObjectCache->setTarget(TheSession->JIT->getTargetMachine());
+
+  TheSession->MainCodeGen = std::make_unique<CodeGen>(TheSession->JIT->getTargetMachine().createDataLayout(), true);
+}
 
-static void InitializeModuleAndPassManager() {
-  // Open a new module
-  TheModule = std::make_unique<llvm::Module>("JIFF", TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-
-  // Create a new pass manager attached to it
-  TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(llvm::createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(llvm::createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(llvm::createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(llvm::createCFGSimplificationPass());
-
-  TheFPM->doInitialization();
-
+// Bring up the target and the JIT, the first time code has to be compiled.
+// Scripts that only evaluate constants never pay for either.
+static void ensureJIT() {
+  if (TheSession->JITStarted)
+    return;
+  TheSession->JITStarted = true;
+
+  // A zygote job may ask for a different object cache than the zygote's
+  // JIT was created with. That job starts over with a JIT of its own.
+  if (TheSession->JIT && ObjectCacheDir != TheSession->ObjectCacheDir) {
+    TheSession->JIT.reset();
+    TheSession->MainCodeGen.reset();
+    TheSession->ObjectCache.reset();
+  }
+  if (!TheSession->JIT)
+    createJIT();
+  if (!SaveSessionPath.empty())
+    TheSession->JIT->setRetainObjects(true);
+
+  if (TheBackend == Backend::Tiered)
+    startTiering(TheTierUpThreshold);
+  else if (SpeculativeCompilation)
+    startSpeculation();
+  else if (TheJobs > 1 && !HotSwap)
+    startCompileWorkers(TheJobs);
 }
 
 static void HandleDefinition() {
 
   if (auto FnAST = ParseDefinition()) {
-    fprintf(stderr, "Parsed a function definition. \n");
-    if (auto *FnIR = FnAST->codegen()) {
-      FnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
-      TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
+    if (TheSession->Echo)
+      fprintf(stderr, "Parsed a function definition. \n");
+    if (TheEmitKind != EmitKind::None) {
+      addAOTDefinition(std::move(FnAST));
+      return;
+    }
+    if (TheBackend == Backend::Interp) {
+      std::string Name = FnAST->getName();
+      FunctionDefs[Name] = std::move(FnAST);
+      return;
+    }
+    if (TheBackend == Backend::VM) {
+      compileBytecodeDefinition(*FnAST);
+      return;
+    }
+    if (TheBackend == Backend::Tiered) {
+      addTieredDefinition(std::move(FnAST));
+      return;
+    }
+    ensureJIT();
+    if (!withinCodeMemoryBudget()) {
+      LogError("JIT code memory budget exceeded");
+      return;
+    }
+    // Only the parsing thread records prototypes, so a worker compiling an
+    // older definition can't put its prototype back over a newer one.
+    addFunctionProto(FnAST->getProto());
+    if (!LazyDefinitions && !HotSwap && TheJobs > 1) {
+      submitDefinition(std::move(FnAST));
+      addCompiledDefinitions(false);
+      return;
+    }
+
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    if (LazyDefinitions) {
+      addLazyDefinition(std::move(FnAST));
+      return;
+    }
+    if (HotSwap) {
+      addHotSwapDefinition(*FnAST);
+      return;
+    }
+
+    if (auto *FnIR = FnAST->codegen(*TheSession->MainCodeGen)) {
+      echoIR(FnIR);
+      TheSession->JIT->addModule(TheSession->MainCodeGen->takeModule());
+      recycleCodeGen(TheSession->MainCodeGen);
+      reclaimModules();
     }
   } else {
     // Skip token for error recovery
-    lexer.getNextToken();
+    TheSession->Lex.getNextToken();
   }
 }
 
 static void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
-    fprintf(stderr, "Parsed an extern \n");
-    if (auto *FnIR = ProtoAST->codegen()) {
-      FnIR->print(llvm::errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    if (TheSession->Echo)
+      fprintf(stderr, "Parsed an extern \n");
+    // Redeclaring a function we already define must not change how it is
+    // called.
+    auto Existing = findFunctionProto(ProtoAST->getName());
+    if (Existing && !Existing->isExternal())
+      return;
+    addFunctionProto(*ProtoAST);
+    // Calls declare the prototype themselves, so there's nothing to do
+    // until there is a JIT.
+    if (!TheSession->JITStarted || TheEmitKind != EmitKind::None)
+      return;
+
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    if (auto *FnIR = ProtoAST->codegen(*TheSession->MainCodeGen)) {
+      echoIR(FnIR);
     }
   } else {
-    lexer.getNextToken();
+    TheSession->Lex.getNextToken();
   }
 }
 
+// import ::= 'import' identifier
+static void HandleImport() {
+  TheSession->Lex.getNextToken(); // eat import
+  if (TheSession->Lex.getCurrentToken() != tok_identifier) {
+    LogError("Expected module name after import");
+    return;
+  }
+  std::string Name = TheSession->Lex.getIdentifierStr();
+  TheSession->Lex.getNextToken();
+  if (TheSession->Echo)
+    fprintf(stderr, "Parsed an import \n");
+
+  // Modules are object code, so something has to link it.
+  if (TheBackend != Backend::JIT && TheEmitKind == EmitKind::None) {
+    LogError("import needs the JIT backend");
+    return;
+  }
+  if (TheEmitKind == EmitKind::None)
+    ensureJIT();
+  std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+  importModule(Name);
+}
+
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function
   if (auto FnAST = ParseTopLevelExpr()) {
-    fprintf(stderr, "Parsed a top-level expr \n");
-    if (auto *FnIR = FnAST->codegen()) {
-      // JIT the module containing the anonymous expression, keeping a handle so
-      // we can free it later.
-      auto H = TheJIT->addModule(std::move(TheModule));
-      InitializeModuleAndPassManager();
+    if (TheSession->Echo)
+      fprintf(stderr, "Parsed a top-level expr \n");
 
-      // Search the JIT for the __anon_expr symbol.
-      auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-      assert(ExprSymbol && "Function not found");
+    if (TheEmitKind != EmitKind::None) {
+      addAOTTopLevelExpr(std::move(FnAST));
+      return;
+    }
 
-      // Get the symbol's address and cast it to the right type (takes no
-      // arguments, returns a double) so we can call it as a native function.
-      double (*FP)() = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
-      fprintf(stderr, "Evaluated to %f\n", FP());
+    if (TheBackend == Backend::VM || TheBackend == Backend::Tiered) {
+      BytecodeFunction F;
+      bool Compiled;
+      {
+        // Compiling can add VM slots, which the tiering worker also reads.
+        std::unique_lock<std::mutex> Lock(TierMutex, std::defer_lock);
+        if (TheBackend == Backend::Tiered)
+          Lock.lock();
+        Compiled = FnAST->compileBytecode(F);
+      }
+      double Result;
+      if (Compiled && runBytecode(F, {}, Result))
+        reportResult(Result);
+      return;
+    }
 
-      // Delete the anonymous expression module from the JIT.
-      TheJIT->removeModule(H);
+    // Code that runs once and calls nothing is not worth compiling.
+    if (TheBackend == Backend::Interp || FnAST->isTrivial()) {
+      runTopLevelBatch();
+      double Result;
+      if (FnAST->interpret({}, Result))
+        reportResult(Result);
+      return;
+    }
 
-      FnIR->print(llvm::errs());
-      // flush stderr
-      fprintf(stderr, "\n");
+    ensureJIT();
 
-      // Remove the anonymous expression.
-      // FnIR->eraseFromParent();
-    }
+    // Wait for just the definitions the expression can reach; the rest keep
+    // compiling while it runs.
+    addDefinitionsReachableFrom(*FnAST);
+
+    if (!runConstantCall(*FnAST))
+      addTopLevelExpr(*FnAST);
   } else {
-    lexer.getNextToken();
+    TheSession->Lex.getNextToken();
   }
 }
 
 static void MainLoop() {
   while(1) {
-    fprintf(stderr, "READY> ");
-    switch(lexer.getCurrentToken()){
+    if (TheSession->Echo)
+      fprintf(stderr, "READY> ");
+    switch(TheSession->Lex.getCurrentToken()){
       case tok_eof:
+        runTopLevelBatch();
         return;
       case ';': // ignore top-level semicolons.
-        lexer.getNextToken();
+        TheSession->Lex.getNextToken();
         break;
       case tok_def:
+        runTopLevelBatch();
         HandleDefinition();
         break;
       case tok_extern:
+        runTopLevelBatch();
         HandleExtern();
         break;
+      case tok_import:
+        runTopLevelBatch();
+        HandleImport();
+        break;
       default:
         HandleTopLevelExpression();
         break;
@@ -329,43 +506,317 @@ static void MainLoop() {
   }
 }
 
+// Parse and run all of F in the session, for the daemon and embedders.
+static void runSource(FILE *F) {
+  TheSession->Lex = Lexer(F);
+  TheSession->Lex.getNextToken();
+  MainLoop();
+  // Everything F defines can be called once this returns.
+  if (TheJobs > 1 && !LazyDefinitions && !HotSwap)
+    addCompiledDefinitions(true);
+}
 
-int main(int argc, char *argv[]) {
-  // a file path was given
-  FILE * fp;
-  if (argc > 1) {
-    char * fileName = argv[1];
-    fprintf(stdout, argv[1], "\n");
+// The embedding API drives the parser above.
+#include "api.cpp"
 
-    // open the file
-    fp = fopen(fileName, "r");
+#ifndef TYLANG_LIBRARY
 
-  } else {
-    fp = stdin;
+// An input file and its name, "<stdin>" for standard input.
+using Input = std::pair<std::string, FILE *>;
+
+// Parse and run every input in turn, as one program. Ahead of time, each one
+// is a separate unit.
+static void runInputs(std::vector<Input> &Inputs) {
+  for (auto &In : Inputs) {
+    if (TheEmitKind != EmitKind::None)
+      beginAOTUnit(In.first);
+    TheSession->Lex = Lexer(In.second);
+
+    // Prime the first token
+    fprintf(stderr, "READY> ");
+    TheSession->Lex.getNextToken();
+    MainLoop();
   }
+}
 
-  lexer = Lexer(fp);
+// Apply the options in argv and open the files it names, in order, into
+// Inputs.
+static bool parseArgs(int argc, char *argv[], std::vector<Input> &Inputs) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
 
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
+    if (arg == "--direct-calls") {
+      DirectCalls = true;
+      continue;
+    }
+    if (arg == "--lazy") {
+      LazyDefinitions = true;
+      continue;
+    }
+    if (arg == "--speculate") {
+      LazyDefinitions = true;
+      SpeculativeCompilation = true;
+      continue;
+    }
+    if (arg == "--jit-stats") {
+      PrintJITStatistics = true;
+      continue;
+    }
+    if (arg.rfind("--object-cache=", 0) == 0) {
+      ObjectCacheDir = arg.substr(strlen("--object-cache="));
+      continue;
+    }
+    if (arg.rfind("--code-memory-budget=", 0) == 0) {
+      char *End;
+      CodeMemoryBudget = strtoull(arg.c_str() + strlen("--code-memory-budget="), &End, 10);
+      switch (tolower(*End)) {
+      case 'g':
+        CodeMemoryBudget <<= 10;
+        LLVM_FALLTHROUGH;
+      case 'm':
+        CodeMemoryBudget <<= 10;
+        LLVM_FALLTHROUGH;
+      case 'k':
+        CodeMemoryBudget <<= 10;
+      }
+      continue;
+    }
+    if (arg == "--hot-swap") {
+      HotSwap = true;
+      continue;
+    }
+    if (arg == "--backend=jit") {
+      TheBackend = Backend::JIT;
+      continue;
+    }
+    if (arg == "--backend=interp") {
+      TheBackend = Backend::Interp;
+      continue;
+    }
+    if (arg == "--backend=vm") {
+      TheBackend = Backend::VM;
+      continue;
+    }
+    if (arg == "--backend=tiered") {
+      TheBackend = Backend::Tiered;
+      continue;
+    }
+    if (arg == "--emit=obj") {
+      TheEmitKind = EmitKind::Object;
+      continue;
+    }
+    if (arg == "--emit=lib") {
+      TheEmitKind = EmitKind::Library;
+      continue;
+    }
+    if (arg == "--emit=exe") {
+      TheEmitKind = EmitKind::Executable;
+      continue;
+    }
+    if (arg == "--emit=module") {
+      TheEmitKind = EmitKind::Module;
+      continue;
+    }
+    if (arg == "--emit=protos") {
+      TheEmitKind = EmitKind::Protos;
+      continue;
+    }
+    if (arg.rfind("--save-session=", 0) == 0) {
+      SaveSessionPath = arg.substr(strlen("--save-session="));
+      continue;
+    }
+    if (arg.rfind("--restore-session=", 0) == 0) {
+      RestoreSessionPath = arg.substr(strlen("--restore-session="));
+      continue;
+    }
+    if (arg == "--no-prelude") {
+      LoadPrelude = false;
+      continue;
+    }
+    if (arg.rfind("--module-path=", 0) == 0) {
+      ModulePath.push_back(arg.substr(strlen("--module-path=")));
+      continue;
+    }
+    if (arg.rfind("--symbol-prefix=", 0) == 0) {
+      AOTSymbolPrefix = arg.substr(strlen("--symbol-prefix="));
+      continue;
+    }
+    if (arg == "-o" && i + 1 < argc) {
+      AOTOutput = argv[++i];
+      continue;
+    }
+    if (arg.rfind("--jobs=", 0) == 0) {
+      TheJobs = std::max(1, atoi(arg.c_str() + strlen("--jobs=")));
+      continue;
+    }
+    if (arg.rfind("--context-recycle-interval=", 0) == 0) {
+      ContextRecycleInterval = atoi(arg.c_str() + strlen("--context-recycle-interval="));
+      continue;
+    }
+    if (arg.rfind("--zygote=", 0) == 0) {
+      ZygoteSocketPath = arg.substr(strlen("--zygote="));
+      continue;
+    }
+    if (arg.rfind("--daemon=", 0) == 0) {
+      DaemonSocketPath = arg.substr(strlen("--daemon="));
+      continue;
+    }
+    if (arg.rfind("--daemon-threads=", 0) == 0) {
+      DaemonThreads = std::max(1, atoi(arg.c_str() + strlen("--daemon-threads=")));
+      continue;
+    }
+    if (arg.rfind("--tier-up-threshold=", 0) == 0) {
+      TheTierUpThreshold = std::max(1, atoi(arg.c_str() + strlen("--tier-up-threshold=")));
+      continue;
+    }
+
+    char * fileName = argv[i];
+    fprintf(stdout, "%s\n", fileName);
+
+    // open the file
+    FILE *fp = fopen(fileName, "r");
+    if (!fp) {
+      fprintf(stderr, "Could not open %s\n", fileName);
+      return false;
+    }
+    Inputs.emplace_back(fileName, fp);
+  }
+  return true;
+}
+
+
+// Run the program in Inputs as the options say, returning the exit status.
+static int run(std::vector<Input> &Inputs) {
+  if (Inputs.empty())
+    Inputs.emplace_back("<stdin>", stdin);
 
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 30;
-  BinopPrecedence['*'] = 40;
+  // A session is the JIT's object code. Stubs don't survive a restart.
+  bool UsesSession = !SaveSessionPath.empty() || !RestoreSessionPath.empty();
+  if (UsesSession && (TheBackend != Backend::JIT || TheEmitKind != EmitKind::None)) {
+    fprintf(stderr, "Sessions need the JIT backend\n");
+    return 1;
+  }
+  if (!SaveSessionPath.empty() && (LazyDefinitions || HotSwap)) {
+    fprintf(stderr, "--save-session can't be used with --lazy, --speculate or --hot-swap\n");
+    return 1;
+  }
+  // Direct calls bake this process's code addresses into the objects.
+  if (!SaveSessionPath.empty() && DirectCalls) {
+    fprintf(stderr, "--save-session can't be used with --direct-calls\n");
+    return 1;
+  }
 
-  // Prime the first token
-  fprintf(stderr, "READY> ");
-  lexer.getNextToken();
+  // Results of batched expressions only come out once the batch runs, which
+  // is fine for a script but not for someone at a prompt.
+  TheSession->BatchTopLevelExprs = TheBackend == Backend::JIT && !isatty(fileno(Inputs[0].second));
 
-  TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+  if (LoadPrelude)
+    registerPrelude();
 
-  InitializeModuleAndPassManager();
+  if (TheEmitKind != EmitKind::None) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
 
+    if (AOTOutput.empty())
+      AOTOutput = defaultAOTOutput(Inputs[0].second == stdin ? "" : Inputs[0].first);
+    if (!ObjectCacheDir.empty())
+      TheSession->ObjectCache = std::make_unique<ObjectFileCache>(ObjectCacheDir);
+    if (!startAOT())
+      return 1;
+
+    runInputs(Inputs);
+    return finishAOT(TheJobs) ? 0 : 1;
+  }
+
+  if (TheBackend == Backend::Interp || TheBackend == Backend::VM) {
+    // Externs are looked up in the host process.
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  } else if (TheBackend == Backend::Tiered || !RestoreSessionPath.empty()) {
+    // Otherwise the JIT waits for the first definition or expression that
+    // needs compiling.
+    ensureJIT();
+    if (!RestoreSessionPath.empty()) {
+      std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+      if (!restoreSession(RestoreSessionPath))
+        return 1;
+    }
+  }
 
   // Run the main "interpreter loop"
-  MainLoop();
+  runInputs(Inputs);
+
+  // A session records the prototypes even if nothing was compiled.
+  if (!SaveSessionPath.empty())
+    ensureJIT();
+
+  // Nothing was started if nothing was compiled.
+  if (TheSession->JITStarted) {
+    if (TheBackend == Backend::Tiered)
+      stopTiering();
+    else if (SpeculativeCompilation)
+      stopSpeculation();
+    else if (TheJobs > 1 && !HotSwap) {
+      addCompiledDefinitions(true);
+      stopCompileWorkers();
+    }
+  }
+
+  bool Saved = true;
+  if (!SaveSessionPath.empty()) {
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    Saved = saveSession(SaveSessionPath);
+  }
 
-  return 0;
+  if (TheSession->JIT && PrintJITStatistics)
+    printJITStatistics();
+
+  // Free the JIT's modules while the contexts they were built in still exist.
+  TheSession->JIT.reset();
+
+  return Saved ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  Argv0 = argv[0];
+  // The CLI runs a single program.
+  Session S;
+  SessionScope Scope(&S);
+
+  std::vector<Input> Inputs;
+  if (!parseArgs(argc, argv, Inputs))
+    return 1;
+
+  if (!ZygoteSocketPath.empty()) {
+    if (!Inputs.empty()) {
+      fprintf(stderr, "--zygote takes no input files\n");
+      return 1;
+    }
+    createJIT();
+    warmUpJIT();
+    // Each job parses its own options, on top of the zygote's.
+    return runZygote(ZygoteSocketPath, [](std::vector<std::string> &Args) {
+      std::vector<char *> Argv;
+      for (auto &Arg : Args)
+        Argv.push_back(&Arg[0]);
+      std::vector<Input> JobInputs;
+      if (!parseArgs(Argv.size(), Argv.data(), JobInputs))
+        return 1;
+      return run(JobInputs);
+    });
+  }
+
+  if (!DaemonSocketPath.empty()) {
+    if (!Inputs.empty() || TheBackend != Backend::JIT || TheEmitKind != EmitKind::None) {
+      fprintf(stderr, "--daemon needs the JIT backend and takes no input files\n");
+      return 1;
+    }
+    if (LoadPrelude)
+      registerPrelude();
+    ensureJIT();
+    return runDaemon(DaemonSocketPath, runSource);
+  }
+
+  return run(Inputs);
 }
+
+#endif
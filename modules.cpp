@@ -0,0 +1,149 @@
+#include "ast.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Precompiled modules. `import name` loads name.tym from the module path: a
+// short text interface followed by the module's object code, written by
+// --emit=module. The interface's prototypes go into FunctionProtos, so code
+// calls the module's functions like any extern, and the object goes to the
+// JIT as it is, with nothing parsed or compiled again.
+//
+//   tylang-module 1
+//   triple x86_64-pc-linux-gnu
+//   import other
+//   def name arg...
+//   object <size>
+//   <size bytes of object code>
+//
+// Every function is exported with the C calling convention, as
+// --emit=obj does. A module's imports are imported along with it.
+
+static const char ModuleMagic[] = "tylang-module 1";
+
+// Directories searched for modules, after the current one.
+static std::vector<std::string> ModulePath;
+
+static bool isImported(const std::string &Name) {
+  for (auto &M : TheSession->ImportedModules)
+    if (M.Name == Name)
+      return true;
+  return false;
+}
+
+// Write a module exporting Protos, implemented by Object, to Path.
+static bool writeModuleFile(const std::string &Path, const llvm::Triple &Triple,
+                            const std::vector<std::unique_ptr<PrototypeAST>> &Protos, llvm::StringRef Object) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+
+  OS << ModuleMagic << "\ntriple " << Triple.str() << "\n";
+  for (auto &M : TheSession->ImportedModules)
+    OS << "import " << M.Name << "\n";
+  for (auto &P : Protos) {
+    OS << "def " << P->getName();
+    for (auto &Arg : P->getArgs())
+      OS << " " << Arg;
+    OS << "\n";
+  }
+  OS << "object " << Object.size() << "\n" << Object;
+  return !OS.has_error();
+}
+
+// Find name.tym in the current directory or on the module path.
+static std::unique_ptr<llvm::MemoryBuffer> findModuleFile(const std::string &Name) {
+  std::vector<std::string> Dirs{"."};
+  Dirs.insert(Dirs.end(), ModulePath.begin(), ModulePath.end());
+  for (auto &Dir : Dirs) {
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, Name + ".tym");
+    if (auto File = llvm::MemoryBuffer::getFile(Path))
+      return std::move(*File);
+  }
+  return nullptr;
+}
+
+static bool loadModule(const std::string &Name);
+
+// Import the module Name and, first, everything it imports. Its functions
+// can be called as soon as this returns true. Caller holds JITMutex, and
+// the JIT, if there is one, gets the object code.
+static bool importModule(const std::string &Name) {
+  if (isImported(Name))
+    return true;
+  // Stale module files can import each other.
+  if (!TheSession->ImportingModules.insert(Name).second) {
+    fprintf(stderr, "Import cycle through %s\n", Name.c_str());
+    return false;
+  }
+  bool Loaded = loadModule(Name);
+  TheSession->ImportingModules.erase(Name);
+  return Loaded;
+}
+
+// Read Name's module file, import its imports and hand over its code.
+static bool loadModule(const std::string &Name) {
+  auto File = findModuleFile(Name);
+  if (!File) {
+    fprintf(stderr, "Could not find module %s\n", Name.c_str());
+    return false;
+  }
+
+  llvm::StringRef Rest = File->getBuffer();
+  llvm::StringRef Line;
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != ModuleMagic) {
+    fprintf(stderr, "%s is not a tylang module\n", Name.c_str());
+    return false;
+  }
+
+  std::vector<std::unique_ptr<PrototypeAST>> Protos;
+  llvm::StringRef Object;
+  while (!Rest.empty()) {
+    std::tie(Line, Rest) = Rest.split('\n');
+    llvm::SmallVector<llvm::StringRef, 8> Fields;
+    Line.split(Fields, ' ', -1, false);
+    if (Fields.empty())
+      continue;
+
+    if (Fields[0] == "triple" && Fields.size() == 2) {
+      if (Fields[1] != llvm::sys::getDefaultTargetTriple()) {
+        fprintf(stderr, "Module %s was compiled for %s\n", Name.c_str(), Fields[1].str().c_str());
+        return false;
+      }
+    } else if (Fields[0] == "import" && Fields.size() == 2) {
+      if (!importModule(Fields[1].str()))
+        return false;
+    } else if (Fields[0] == "def" && Fields.size() >= 2) {
+      std::vector<std::string> Args;
+      for (auto &Arg : llvm::makeArrayRef(Fields).drop_front(2))
+        Args.push_back(Arg.str());
+      Protos.push_back(std::make_unique<PrototypeAST>(Fields[1].str(), std::move(Args), true));
+    } else if (Fields[0] == "object" && Fields.size() == 2) {
+      size_t Size;
+      if (Fields[1].getAsInteger(10, Size) || Size > Rest.size())
+        break;
+      Object = Rest.take_front(Size);
+      break;
+    } else {
+      break;
+    }
+  }
+  if (Object.empty()) {
+    fprintf(stderr, "Module %s is malformed\n", Name.c_str());
+    return false;
+  }
+
+  if (TheSession->JIT)
+    TheSession->JIT->addObject(llvm::MemoryBuffer::getMemBufferCopy(Object, Name + ".o"));
+  for (auto &P : Protos)
+    addFunctionProto(*P);
+  TheSession->ImportedModules.push_back({Name, llvm::MemoryBuffer::getMemBufferCopy(Object, Name + ".o")});
+  return true;
+}
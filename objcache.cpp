@@ -0,0 +1,114 @@
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+// A persistent cache of object files (--object-cache=DIR). An object is
+// stored under a hash of the module's optimized IR plus everything about the
+// target that affects the machine code, so a later run that produces the
+// same module loads the object instead of running the backend.
+//
+// Code generation rewrites the module it compiles, so the key is computed on
+// lookup and remembered until the object comes back. Files are written under
+// a temporary name and renamed into place, so threads and processes sharing a
+// directory never see half an object.
+class ObjectFileCache : public llvm::ObjectCache {
+public:
+  ObjectFileCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+  // Record the target the cached objects are compiled for. Must be called
+  // before the first lookup.
+  void setTarget(const llvm::TargetMachine &TM) {
+    Target.clear();
+    llvm::raw_string_ostream OS(Target);
+    OS << TM.getTargetTriple().str() << '\n'
+       << TM.getTargetCPU() << '\n'
+       << TM.getTargetFeatureString() << '\n'
+       << (int)TM.getOptLevel() << ' ' << (int)TM.getRelocationModel() << ' '
+       << (int)TM.getCodeModel() << '\n'
+       // Bump when the way objects are produced changes.
+       << "tylang-objcache-1\n";
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+    std::string Path = pathFor(*M);
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      PendingPaths[M] = Path;
+      Misses++;
+      return nullptr;
+    }
+    Hits++;
+    return std::move(*Buffer);
+  }
+
+  void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override {
+    std::string Path;
+    {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      auto PI = PendingPaths.find(M);
+      if (PI == PendingPaths.end())
+        return;
+      Path = std::move(PI->second);
+      PendingPaths.erase(PI);
+    }
+    if (llvm::sys::fs::create_directories(Dir))
+      return;
+
+    llvm::SmallString<128> TempPath;
+    int FD;
+    if (llvm::sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath))
+      return;
+    {
+      llvm::raw_fd_ostream OS(FD, true);
+      OS << Obj.getBuffer();
+      if (OS.has_error()) {
+        OS.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return;
+      }
+    }
+    if (llvm::sys::fs::rename(TempPath, Path))
+      llvm::sys::fs::remove(TempPath);
+  }
+
+  unsigned getHits() const { return Hits; }
+  unsigned getMisses() const { return Misses; }
+
+private:
+  std::string pathFor(const llvm::Module &M) {
+    std::string IR;
+    {
+      llvm::raw_string_ostream OS(IR);
+      M.print(OS, nullptr);
+    }
+
+    llvm::MD5 Hash;
+    Hash.update(Target);
+    Hash.update(IR);
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, std::string(Result.digest().str()) + ".o");
+    return std::string(Path.str());
+  }
+
+  std::string Dir;
+  std::string Target;
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+  // Keys of the modules being compiled after a miss.
+  std::mutex PendingMutex;
+  std::map<const llvm::Module *, std::string> PendingPaths;
+};
+
@@ -0,0 +1,299 @@
+#include "ast.h"
+
+// Parallel, pipelined compilation of definitions (--jobs=N). The main thread
+// parses and pushes each definition onto CompileQueue, then goes straight on
+// to parsing the next one. Workers pop them concurrently. Each worker owns a
+// CodeGen, and so its own LLVMContext, plus a TargetMachine, so it can lower,
+// optimize and emit a definition to an object file sharing nothing but
+// FunctionProtos.
+//
+// The main thread hands finished objects to the JIT as they come in. A
+// top-level expression only waits for the definitions it can reach.
+//
+// Every session in the process shares the workers. Each job carries its
+// session, and the workers' code generators start a new module per job.
+
+using CompileJob = std::function<void(CodeGen &, llvm::TargetMachine &)>;
+
+// A bounded multi-producer multi-consumer queue that never takes a lock.
+// Each cell carries a sequence number saying whether it is ready to be
+// written or read for the current lap around the ring.
+template <typename T, size_t Capacity> class BoundedQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  Cell cells[Capacity];
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+public:
+  BoundedQueue() {
+    for (size_t i = 0; i != Capacity; ++i)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // Returns false if the queue is full.
+  bool tryPush(T &value) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (1) {
+      cell = &cells[pos & (Capacity - 1)];
+      intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool tryPop(T &value) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (1) {
+      cell = &cells[pos & (Capacity - 1)];
+      intptr_t diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->data);
+    cell->seq.store(pos + Capacity, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_seq_cst) == tail.load(std::memory_order_seq_cst);
+  }
+};
+
+// Enough to keep the workers busy while the parser runs ahead, small enough
+// that a long program doesn't pile up ASTs faster than they compile.
+static BoundedQueue<CompileJob, 64> CompileQueue;
+
+static std::vector<std::thread> CompileWorkers;
+static std::mutex CompileWorkersMutex;
+static std::atomic<bool> CompileShutdown{false};
+// Workers sleep here when the queue is empty. The mutex is only for sleeping
+// and waking; the queue itself doesn't need it.
+static std::mutex CompileSleepMutex;
+static std::condition_variable CompileCV;
+static std::atomic<unsigned> IdleCompileWorkers{0};
+
+static void compileWorker() {
+  llvm::TargetMachine &TM = llvm::orc::KaleidoscopeJIT::getCompileTargetMachine();
+  auto CG = std::make_unique<CodeGen>(TM.createDataLayout(), false);
+
+  CompileJob Job;
+  while (1) {
+    if (CompileQueue.tryPop(Job)) {
+      Job(*CG, TM);
+      Job = nullptr;
+      recycleCodeGen(CG);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> Lock(CompileSleepMutex);
+    IdleCompileWorkers++;
+    CompileCV.wait(Lock, [] { return CompileShutdown || !CompileQueue.empty(); });
+    IdleCompileWorkers--;
+    // Finish what is queued before shutting down.
+    if (CompileShutdown && CompileQueue.empty())
+      return;
+  }
+}
+
+// Start the workers, unless another session already has.
+static void startCompileWorkers(unsigned NumWorkers) {
+  std::lock_guard<std::mutex> Lock(CompileWorkersMutex);
+  if (!CompileWorkers.empty())
+    return;
+  for (unsigned i = 0; i != NumWorkers; ++i)
+    CompileWorkers.emplace_back(compileWorker);
+}
+
+static void stopCompileWorkers() {
+  std::lock_guard<std::mutex> WorkersLock(CompileWorkersMutex);
+  {
+    std::lock_guard<std::mutex> Lock(CompileSleepMutex);
+    CompileShutdown = true;
+  }
+  CompileCV.notify_all();
+  for (auto &Worker : CompileWorkers)
+    Worker.join();
+  CompileWorkers.clear();
+}
+
+// Embedders never stop the workers, so they stop at exit, before the
+// threads are destroyed.
+static struct CompileWorkersStopper {
+  ~CompileWorkersStopper() {
+    if (!CompileWorkers.empty())
+      stopCompileWorkers();
+  }
+} StopCompileWorkersAtExit;
+
+// Give the JIT the object for D, unless a newer definition of one of its
+// names beat it there. That newer one was compiled along with everything
+// that calls it, so D has nothing left to contribute.
+static void addCompiledDefinition(PendingDefinition &D) {
+  std::unique_ptr<llvm::MemoryBuffer> Obj = D.Obj.get();
+  // The worker already printed them.
+  if (CollectedErrors)
+    CollectedErrors->insert(CollectedErrors->end(), D.Errors->begin(), D.Errors->end());
+  if (!Obj)
+    return;
+
+  for (auto &Name : D.Names) {
+    auto AI = TheSession->AddedDefinitionSeqs.find(Name);
+    if (AI != TheSession->AddedDefinitionSeqs.end() && AI->second > D.Seq)
+      return;
+  }
+  for (auto &Name : D.Names)
+    TheSession->AddedDefinitionSeqs[Name] = D.Seq;
+
+  std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+  TheSession->JIT->addObject(std::move(Obj));
+  reclaimModules();
+}
+
+// Hand every finished object to the JIT, or wait for all of them if Wait is
+// set.
+static void addCompiledDefinitions(bool Wait) {
+  for (auto I = TheSession->PendingDefinitions.begin(); I != TheSession->PendingDefinitions.end();) {
+    if (!Wait && I->Obj.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      ++I;
+      continue;
+    }
+    addCompiledDefinition(*I);
+    I = TheSession->PendingDefinitions.erase(I);
+  }
+}
+
+// Make sure the JIT has every definition Fn can reach, waiting for the ones
+// still being compiled.
+static void addDefinitionsReachableFrom(const FunctionAST &Fn) {
+  std::set<std::string> Reachable;
+  std::vector<std::string> Work;
+  Fn.getCallees(Work);
+  while (!Work.empty()) {
+    std::string Name = Work.back();
+    Work.pop_back();
+    if (!Reachable.insert(Name).second)
+      continue;
+    auto NI = TheSession->CallGraph.find(Name);
+    if (NI != TheSession->CallGraph.end())
+      Work.insert(Work.end(), NI->second.Callees.begin(), NI->second.Callees.end());
+  }
+
+  for (auto I = TheSession->PendingDefinitions.begin(); I != TheSession->PendingDefinitions.end();) {
+    bool Needed = false;
+    for (auto &Name : I->Names)
+      Needed |= Reachable.count(Name) != 0;
+    if (!Needed && I->Obj.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      ++I;
+      continue;
+    }
+    addCompiledDefinition(*I);
+    I = TheSession->PendingDefinitions.erase(I);
+  }
+}
+
+// Queue Job, waiting for the workers if they have fallen behind instead of
+// parsing further ahead, and handing over what they finish in the meantime.
+static void pushCompileJob(CompileJob &Job) {
+  while (!CompileQueue.tryPush(Job)) {
+    addCompiledDefinitions(false);
+    std::this_thread::yield();
+  }
+
+  // Pairs with the idle count going up before a worker checks the queue, so
+  // either we see it sleeping or it sees the job.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (IdleCompileWorkers) {
+    std::lock_guard<std::mutex> Lock(CompileSleepMutex);
+    CompileCV.notify_one();
+  }
+}
+
+// Queue Fn to be compiled on the workers. Its prototype must already be
+// registered so later definitions can call it before it is compiled.
+//
+// Redefining a function also recompiles everything that calls it, since
+// their code is bound to the old definition. The batch goes out in waves of
+// strongly connected components. A unit waits for the units it calls before
+// it starts, so its object never reaches the JIT ahead of theirs; units in
+// the same wave compile in parallel. Queued jobs are popped in order, so
+// whatever a unit waits for is already running or done.
+static void submitDefinition(std::shared_ptr<FunctionAST> Fn) {
+  std::set<std::string> Batch{Fn->getName()};
+  if (isDefinedInCallGraph(Fn->getName()))
+    addStaleCallers(Fn->getName(), Batch);
+  addToCallGraph(Fn);
+
+  std::vector<CompileUnit> Units = planCompileUnits(Batch);
+  std::vector<std::shared_future<void>> Done(Units.size());
+  unsigned Waves = 0;
+  for (auto &U : Units)
+    Waves = std::max(Waves, U.Wave + 1);
+
+  for (unsigned W = 0; W != Waves; ++W) {
+    for (unsigned i = 0, e = Units.size(); i != e; ++i) {
+      CompileUnit &U = Units[i];
+      if (U.Wave != W)
+        continue;
+
+      std::vector<std::string> Names;
+      for (auto &F : U.Functions)
+        Names.push_back(F->getName());
+      std::vector<std::shared_future<void>> Deps;
+      for (unsigned D : U.Deps)
+        Deps.push_back(Done[D]);
+
+      auto Obj = std::make_shared<std::promise<std::unique_ptr<llvm::MemoryBuffer>>>();
+      auto Finished = std::make_shared<std::promise<void>>();
+      auto Errors = std::make_shared<std::vector<std::string>>();
+      TheSession->PendingDefinitions.push_back({Names, TheSession->NextDefinitionSeq++, Obj->get_future(), Errors});
+      Done[i] = Finished->get_future().share();
+
+      Session *S = TheSession;
+      CompileJob Job = [S, Functions = U.Functions, Deps, Obj, Finished, Errors](CodeGen &CG,
+                                                                                 llvm::TargetMachine &TM) {
+        // Workers don't belong to any one session.
+        SessionScope Scope(S);
+        for (auto &D : Deps)
+          D.wait();
+
+        bool Compiled = true;
+        CollectedErrors = Errors.get();
+        for (auto &F : Functions)
+          Compiled = Compiled && F->codegen(CG);
+        CollectedErrors = nullptr;
+        if (Compiled) {
+          Obj->set_value(emitObject(TM, *CG.takeModule()));
+        } else {
+          CG.newModule();
+          Obj->set_value(nullptr);
+        }
+        Finished->set_value();
+      };
+      pushCompileJob(Job);
+    }
+  }
+}
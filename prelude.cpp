@@ -0,0 +1,82 @@
+#include "ast.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+// The standard prelude, prelude.ty. `make` compiles it with a bootstrap build
+// of tylang and links the object into the final binary. Its prototypes come
+// from a table generated with --emit=protos, so starting up registers them
+// without parsing or compiling anything.
+//
+// prelude.o exports its definitions as tylang_prelude_NAME, so they can't
+// clash with an embedder's own functions or a library a program is compiled
+// into. The table has their addresses, which are registered with the process
+// under both names, so every backend finds them like it finds libm's.
+
+#ifdef TYLANG_PRELUDE
+// A prototype, "name arg...". For a definition, also the symbol prelude.o
+// exports it as and its address.
+struct PreludeFunction {
+  const char *Proto;
+  const char *Symbol;
+  void *Addr;
+};
+
+// Defines PreludeFunctions.
+#include "prelude.inc"
+#endif
+
+// Cleared by --no-prelude.
+static bool LoadPrelude = true;
+// For finding the binary, and the prelude object next to it.
+static const char *Argv0 = "tylang";
+
+static void registerPrelude() {
+#ifdef TYLANG_PRELUDE
+  for (auto &F : PreludeFunctions) {
+    llvm::SmallVector<llvm::StringRef, 8> Fields;
+    llvm::StringRef(F.Proto).split(Fields, ' ', -1, false);
+    std::vector<std::string> Args;
+    for (auto &Arg : llvm::makeArrayRef(Fields).drop_front())
+      Args.push_back(Arg.str());
+    addFunctionProto(PrototypeAST(Fields[0].str(), std::move(Args), true));
+    // JIT'd code calls it by its name, imported modules by its symbol.
+    if (F.Addr) {
+      llvm::sys::DynamicLibrary::AddSymbol(Fields[0], F.Addr);
+      llvm::sys::DynamicLibrary::AddSymbol(F.Symbol, F.Addr);
+    }
+  }
+#endif
+}
+
+// Point M's calls to the prelude's definitions at the symbols prelude.o
+// exports them as. Names M defines itself keep their own.
+static void bindPreludeSymbols(llvm::Module &M) {
+#ifdef TYLANG_PRELUDE
+  if (!LoadPrelude)
+    return;
+  for (auto &F : PreludeFunctions) {
+    if (!F.Symbol)
+      continue;
+    auto *Fn = M.getFunction(llvm::StringRef(F.Proto).split(' ').first);
+    if (Fn && Fn->isDeclaration())
+      Fn->setName(F.Symbol);
+  }
+#endif
+}
+
+// The prelude's object code, which ahead-of-time outputs need since they
+// don't run inside tylang. Installed next to the binary. Null if the prelude
+// isn't loaded or the object isn't there.
+static std::unique_ptr<llvm::MemoryBuffer> loadPreludeObject() {
+#ifdef TYLANG_PRELUDE
+  if (!LoadPrelude)
+    return nullptr;
+  llvm::SmallString<128> Path(llvm::sys::fs::getMainExecutable(Argv0, (void *)&loadPreludeObject));
+  llvm::sys::path::remove_filename(Path);
+  llvm::sys::path::append(Path, "prelude.o");
+  if (auto Obj = llvm::MemoryBuffer::getFile(Path))
+    return std::move(*Obj);
+#endif
+  return nullptr;
+}
@@ -0,0 +1,129 @@
+#include "ast.h"
+
+// Reclaiming code that nothing can call any more.
+//
+// The JIT reports a module as superseded once every name it defines has a
+// newer definition and every module that could have linked against it is
+// gone. That alone doesn't make it safe to free: a thread may be in the middle
+// of running it (epoch-based reclamation). A thread runs JIT'd code inside an
+// EpochGuard, which publishes the global epoch it entered in. A superseded
+// module is retired with the epoch at the time, and freed once every thread
+// in JIT'd code entered after that. The tiered backend retires its modules
+// itself, since their entry points never get newer definitions.
+//
+// All of this runs under JITMutex, or on the tiering worker, the only thread
+// that touches the tiered backend's JIT. EpochGuard is the exception.
+
+struct EpochRecord {
+  // 0 while the thread is outside JIT'd code.
+  std::atomic<uint64_t> Epoch{0};
+};
+
+static std::atomic<uint64_t> GlobalEpoch{1};
+static std::mutex EpochRecordsMutex;
+static std::vector<EpochRecord *> EpochRecords;
+
+// Registers the calling thread's record for as long as the thread lives.
+struct ThreadEpochRecord {
+  EpochRecord Record;
+
+  ThreadEpochRecord() {
+    std::lock_guard<std::mutex> Lock(EpochRecordsMutex);
+    EpochRecords.push_back(&Record);
+  }
+  ~ThreadEpochRecord() {
+    std::lock_guard<std::mutex> Lock(EpochRecordsMutex);
+    EpochRecords.erase(std::find(EpochRecords.begin(), EpochRecords.end(), &Record));
+  }
+};
+
+// Marks the calling thread as running JIT'd code until it goes out of scope.
+class EpochGuard {
+  EpochRecord &Record;
+  uint64_t Outer;
+
+public:
+  EpochGuard() : Record(threadRecord()) {
+    // JIT'd code can call back into a guarded host function; the outermost
+    // guard's epoch is the one that counts.
+    Outer = Record.Epoch.load(std::memory_order_relaxed);
+    if (!Outer)
+      Record.Epoch.store(GlobalEpoch.load());
+  }
+  ~EpochGuard() {
+    if (!Outer)
+      Record.Epoch.store(0, std::memory_order_release);
+  }
+
+private:
+  static EpochRecord &threadRecord() {
+    static thread_local ThreadEpochRecord R;
+    return R.Record;
+  }
+};
+
+// Code memory (bytes) the JIT may hold before definitions are refused. 0 for
+// no limit.
+static uint64_t CodeMemoryBudget = 0;
+
+// Free every retired module that no thread can still be running, after
+// retiring whatever the JIT has found superseded since the last call.
+// Freeing a module can unpin the ones it was linked against, so this goes on
+// until nothing more can be freed.
+static void reclaimModules() {
+  while (1) {
+    for (auto K : TheSession->JIT->takeSupersededModules())
+      // Threads that entered in this epoch or earlier may have reached K
+      // before it was superseded; later ones can't.
+      TheSession->RetiredModules.push_back({K, GlobalEpoch.fetch_add(1)});
+    if (TheSession->RetiredModules.empty())
+      return;
+
+    uint64_t Oldest = UINT64_MAX;
+    {
+      std::lock_guard<std::mutex> Lock(EpochRecordsMutex);
+      for (auto *R : EpochRecords) {
+        uint64_t E = R->Epoch.load();
+        if (E && E < Oldest)
+          Oldest = E;
+      }
+    }
+
+    auto Live = std::remove_if(TheSession->RetiredModules.begin(), TheSession->RetiredModules.end(), [&](const RetiredModule &M) {
+      if (M.Epoch >= Oldest)
+        return false;
+      TheSession->JIT->removeModule(M.K);
+      return true;
+    });
+    if (Live == TheSession->RetiredModules.end())
+      return;
+    TheSession->RetiredModules.erase(Live, TheSession->RetiredModules.end());
+  }
+}
+
+// Whether there is room for more code. Reclaims what it can first.
+static bool withinCodeMemoryBudget() {
+  if (!CodeMemoryBudget)
+    return true;
+  reclaimModules();
+  return TheSession->JIT->getAllocatedBytes() < CodeMemoryBudget;
+}
+
+static void printJITStatistics() {
+  auto S = TheSession->JIT->getStatistics();
+  fprintf(stderr, "JIT statistics:\n");
+  fprintf(stderr, "  code bytes:      %llu\n", (unsigned long long)S.CodeBytes);
+  fprintf(stderr, "  data bytes:      %llu\n", (unsigned long long)S.DataBytes);
+  fprintf(stderr, "  peak bytes:      %llu\n", (unsigned long long)S.PeakBytes);
+  if (CodeMemoryBudget)
+    fprintf(stderr, "  budget bytes:    %llu\n", (unsigned long long)CodeMemoryBudget);
+  fprintf(stderr, "  live modules:    %u\n", S.LiveModules);
+  fprintf(stderr, "  modules added:   %u\n", S.ModulesAdded);
+  fprintf(stderr, "  modules removed: %u\n", S.ModulesRemoved);
+  fprintf(stderr, "  retired modules: %zu\n", TheSession->RetiredModules.size());
+  fprintf(stderr, "  slab bytes:      %llu\n", (unsigned long long)llvm::orc::SharedCodeAllocator::get().getMappedBytes());
+  if (TheSession->ObjectCache) {
+    fprintf(stderr, "  cache hits:      %u\n", TheSession->ObjectCache->getHits());
+    fprintf(stderr, "  cache misses:    %u\n", TheSession->ObjectCache->getMisses());
+  }
+}
@@ -0,0 +1,169 @@
+#include "ast.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Sessions are declared in session.h, where the types they own may not be
+// complete yet.
+Session::Session() {
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 30;
+  BinopPrecedence['*'] = 40;
+}
+
+Session::~Session() = default;
+
+// Session snapshots. --save-session=FILE writes, on exit, every prototype and
+// the object code of every module still in the JIT. --restore-session=FILE
+// maps such a file and hands the objects to the JIT in the same order, so
+// every name resolves as it did, without parsing or compiling anything.
+//
+//   tylang-session 2
+//   triple x86_64-pc-linux-gnu
+//   proto name c|fast arg...
+//   object <size> <linked after>
+//   <padding to a multiple of 16 bytes from the start of the file>
+//   <size bytes of object code>
+//   end
+//
+// Objects are aligned, so the JIT reads them where they are mapped. Code
+// addresses change from run to run, so each object is still relocated, when
+// it is linked. The JIT links a module on the first lookup of a name it
+// defines, binding each name it uses to the newest definition at that time,
+// which may be a later redefinition than the ones before it. So each object
+// records how many objects had been added when it was linked, and restoring
+// links it at that same point. One that was never linked is left to link on
+// first use, as it would have.
+
+static const char SessionMagic[] = "tylang-session 2";
+static const unsigned SessionObjectAlignment = 16;
+
+static std::string SaveSessionPath;
+static std::string RestoreSessionPath;
+// The restored session, mapped for as long as its objects are in the JIT.
+static std::unique_ptr<llvm::sys::fs::mapped_file_region> RestoredSession;
+
+static bool saveSession(const std::string &Path) {
+  llvm::SmallString<128> TempPath;
+  int FD;
+  if (auto EC = llvm::sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath)) {
+    fprintf(stderr, "Could not write %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+
+  {
+    llvm::raw_fd_ostream OS(FD, true);
+    OS << SessionMagic << "\ntriple " << TheSession->JIT->getTargetMachine().getTargetTriple().str() << "\n";
+    for (auto &P : getFunctionProtos()) {
+      // Only ever called from C++, never by name.
+      if (P->getName() == "__anon_expr")
+        continue;
+      OS << "proto " << P->getName() << (P->isExternal() ? " c" : " fast");
+      for (auto &Arg : P->getArgs())
+        OS << " " << Arg;
+      OS << "\n";
+    }
+    for (auto &Obj : TheSession->JIT->getObjects()) {
+      OS << "object " << Obj.Object.getBufferSize() << " " << Obj.LinkedAfter << "\n";
+      OS.indent(llvm::alignTo(OS.tell(), SessionObjectAlignment) - OS.tell());
+      OS << Obj.Object.getBuffer() << "\n";
+    }
+    OS << "end\n";
+    if (OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TempPath);
+      fprintf(stderr, "Could not write %s\n", Path.c_str());
+      return false;
+    }
+  }
+
+  // Whoever restores it sees the old session or the new one, never half.
+  if (auto EC = llvm::sys::fs::rename(TempPath, Path)) {
+    llvm::sys::fs::remove(TempPath);
+    fprintf(stderr, "Could not write %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+  return true;
+}
+
+// Caller holds JITMutex.
+static bool restoreSession(const std::string &Path) {
+  int FD;
+  uint64_t Size;
+  if (llvm::sys::fs::openFileForRead(Path, FD) || llvm::sys::fs::file_size(Path, Size)) {
+    fprintf(stderr, "Could not open %s\n", Path.c_str());
+    return false;
+  }
+  std::error_code EC;
+  RestoredSession = std::make_unique<llvm::sys::fs::mapped_file_region>(
+      FD, llvm::sys::fs::mapped_file_region::readonly, Size, 0, EC);
+  close(FD);
+  if (EC) {
+    fprintf(stderr, "Could not map %s: %s\n", Path.c_str(), EC.message().c_str());
+    RestoredSession.reset();
+    return false;
+  }
+
+  const char *Start = RestoredSession->const_data();
+  llvm::StringRef Rest(Start, Size);
+  llvm::StringRef Line;
+  std::tie(Line, Rest) = Rest.split('\n');
+  if (Line != SessionMagic) {
+    fprintf(stderr, "%s is not a tylang session\n", Path.c_str());
+    return false;
+  }
+
+  // Objects added so far, and the ones to link once a later one is added.
+  unsigned Objects = 0;
+  std::multimap<unsigned, llvm::orc::VModuleKey> Unlinked;
+  while (!Rest.empty()) {
+    std::tie(Line, Rest) = Rest.split('\n');
+    llvm::SmallVector<llvm::StringRef, 8> Fields;
+    Line.split(Fields, ' ', -1, false);
+    if (Fields.empty())
+      break;
+
+    if (Fields[0] == "end") {
+      if (!Unlinked.empty())
+        break;
+      return true;
+    } else if (Fields[0] == "triple" && Fields.size() == 2) {
+      if (Fields[1] != TheSession->JIT->getTargetMachine().getTargetTriple().str()) {
+        fprintf(stderr, "%s was saved for %s\n", Path.c_str(), Fields[1].str().c_str());
+        return false;
+      }
+    } else if (Fields[0] == "proto" && Fields.size() >= 3) {
+      std::vector<std::string> Args;
+      for (auto &Arg : llvm::makeArrayRef(Fields).drop_front(3))
+        Args.push_back(Arg.str());
+      addFunctionProto(PrototypeAST(Fields[1].str(), std::move(Args), Fields[2] == "c"));
+    } else if (Fields[0] == "object" && Fields.size() == 3) {
+      uint64_t ObjSize;
+      unsigned LinkedAfter;
+      uint64_t Offset = llvm::alignTo(Rest.data() - Start, SessionObjectAlignment);
+      if (Fields[1].getAsInteger(10, ObjSize) || Fields[2].getAsInteger(10, LinkedAfter) ||
+          Offset + ObjSize > Size || (LinkedAfter && LinkedAfter <= Objects))
+        break;
+      llvm::StringRef Obj(Start + Offset, ObjSize);
+      auto K = TheSession->JIT->addObject(llvm::MemoryBuffer::getMemBuffer(Obj, Path, false));
+      if (LinkedAfter)
+        Unlinked.insert({LinkedAfter, K});
+      ++Objects;
+      auto Linked = Unlinked.equal_range(Objects);
+      for (auto I = Linked.first; I != Linked.second; ++I) {
+        if (auto Err = TheSession->JIT->linkModule(I->second)) {
+          llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Could not restore " + Path + ": ");
+          return false;
+        }
+      }
+      Unlinked.erase(Linked.first, Linked.second);
+      Rest = llvm::StringRef(Obj.end(), Start + Size - Obj.end()).drop_front();
+    } else {
+      break;
+    }
+  }
+
+  fprintf(stderr, "%s is malformed\n", Path.c_str());
+  return false;
+}
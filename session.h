@@ -0,0 +1,141 @@
+#ifndef TYLANG_SESSION_H
+#define TYLANG_SESSION_H
+
+#include "KaleidoscopeJIT.h"
+#include "ast.h"
+#include "lexer/lexer.h"
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// A session is one program compiled with the JIT: its parser state, function
+// table, code generator and JIT, and everything the JIT's drivers track for
+// it. Sessions share none of it, so a process can hold any number of them.
+// What they do share is only what makes each one cheaper: the compile
+// workers, the slabs code is linked into and a target machine per thread
+// that emits code (see KaleidoscopeJIT.h).
+//
+// Code finds the session it works on through TheSession, which a thread sets
+// with a SessionScope for as long as it works on that session. Threads that
+// serve several sessions, like the compile workers, set it per job.
+//
+// The CLI's other modes (lazy, hot-swap, tiered, the interpreter, the VM and
+// ahead-of-time compilation) keep their state at file scope: the CLI only
+// ever has one session.
+
+struct CodeGen;
+class ObjectFileCache;
+
+// A module the JIT reported superseded, freed once no thread that entered
+// JIT'd code in Epoch or earlier is still in it. See reclaim.cpp.
+struct RetiredModule {
+  llvm::orc::VModuleKey K;
+  uint64_t Epoch;
+};
+
+// A definition in the call graph. See depgraph.cpp.
+struct CallGraphNode {
+  // Null for a name that is called but not defined, like an extern.
+  std::shared_ptr<FunctionAST> Fn;
+  std::set<std::string> Callees;
+  std::set<std::string> Callers;
+};
+
+// An object being compiled for one compile unit. See parallel.cpp.
+struct PendingDefinition {
+  std::vector<std::string> Names;
+  // Position in submission order, so an older definition finishing late
+  // never shadows a newer one.
+  unsigned Seq;
+  // Null if compilation failed.
+  std::future<std::unique_ptr<llvm::MemoryBuffer>> Obj;
+  // What the worker reported, for the thread that collects Obj. Complete
+  // once Obj is ready.
+  std::shared_ptr<std::vector<std::string>> Errors;
+};
+
+// A precompiled module that was imported. See modules.cpp.
+struct ImportedModule {
+  std::string Name;
+  // A copy, since object files have to be aligned and within the module
+  // file it may not be.
+  std::unique_ptr<llvm::MemoryBuffer> Object;
+};
+
+// Calls a function of some arity and calling convention at an address, with
+// arguments from an array. See toplevel.cpp.
+using Trampoline = double (*)(void *, const double *);
+
+struct Session {
+  Session();
+  ~Session();
+
+  // Echo prompts, what was parsed, IR and results to stderr, as the REPL
+  // does. Embedders turn it off.
+  bool Echo = true;
+
+  Lexer Lex;
+  std::map<char, int> BinopPrecedence;
+
+  // Prototypes of every function that can be called, shared by all code
+  // generators. Only access it through the helpers in codegen.cpp.
+  std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+  std::mutex FunctionProtosMutex;
+
+  // Serializes everything that touches the JIT or MainCodeGen. Nobody holds
+  // it while JIT'd code runs, since a first call to a lazy definition
+  // compiles on the calling thread.
+  std::mutex JITMutex;
+  // Declared before the JIT, which uses them, so they outlive it.
+  std::unique_ptr<ObjectFileCache> ObjectCache;
+  // Where createJIT opened ObjectCache. Empty if the JIT has none.
+  std::string ObjectCacheDir;
+  // Code generator for the thread that parses.
+  std::unique_ptr<CodeGen> MainCodeGen;
+  std::unique_ptr<llvm::orc::KaleidoscopeJIT> JIT;
+  // Set once ensureJIT has run, and the JIT's threads, if any, need stopping.
+  bool JITStarted = false;
+
+  // Top-level expressions, see toplevel.cpp.
+  std::map<std::pair<unsigned, llvm::CallingConv::ID>, Trampoline> Trampolines;
+  // Whether to batch expressions. Only set when nobody is waiting on each
+  // result as it is typed.
+  bool BatchTopLevelExprs = false;
+  // Entry points in MainCodeGen's module, in source order.
+  std::vector<std::string> TopLevelBatch;
+  unsigned NextTopLevelEntry = 0;
+
+  std::vector<RetiredModule> RetiredModules;
+
+  std::map<std::string, CallGraphNode> CallGraph;
+  // Submitted definitions whose objects the JIT doesn't have yet, oldest
+  // first.
+  std::deque<PendingDefinition> PendingDefinitions;
+  unsigned NextDefinitionSeq = 0;
+  // Seq of the definition of each name the JIT currently has.
+  std::map<std::string, unsigned> AddedDefinitionSeqs;
+
+  // In the order they were imported, dependencies first.
+  std::vector<ImportedModule> ImportedModules;
+  // Modules whose imports are being imported.
+  std::set<std::string> ImportingModules;
+};
+
+// The session the calling thread is working on.
+static thread_local Session *TheSession = nullptr;
+
+// Makes S the calling thread's session until it goes out of scope.
+class SessionScope {
+  Session *Outer;
+
+public:
+  SessionScope(Session *S) : Outer(TheSession) { TheSession = S; }
+  ~SessionScope() { TheSession = Outer; }
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "ast.h"
+
+// Tiered execution. Definitions start out as bytecode, which is cheap to
+// produce. The VM counts calls, and once a function crosses TierUpThreshold
+// it is compiled by the JIT at full optimization on a background thread. The
+// finished machine code is published through the function's entry in
+// TieredEntries, which the VM checks on every call. Redefining a function
+// unpublishes all of it, and the worker retires the modules it was in once
+// it starts on the next epoch's code.
+//
+// Only the worker thread touches the JIT, and it has its own code generator.
+// The rest of what the main thread shares with it is guarded by TierMutex.
+// Prototypes are only recorded by the main thread.
+
+struct TierUpRequest {
+  // A hot function and every function it can reach that is still bytecode,
+  // so the machine code never has to call back into the VM.
+  std::vector<std::shared_ptr<FunctionAST>> Functions;
+  // Null for a function the VM can't call as machine code.
+  std::vector<std::atomic<void *> *> Entries;
+  // TierEpoch when the request was made.
+  unsigned Epoch;
+};
+
+static std::mutex TierMutex;
+static std::condition_variable TierCV;
+static std::deque<TierUpRequest> TierQueue;
+// Functions queued or compiled in the current epoch.
+static std::set<std::string> TierPending;
+// Bumped whenever a function is redefined, which discards all machine code
+// compiled against the old definitions.
+static unsigned TierEpoch = 0;
+static unsigned TierUnits = 0;
+static bool TierShutdown = false;
+static std::thread TierWorker;
+static std::unique_ptr<CodeGen> TierCodeGen;
+// Modules compiled for TierModulesEpoch. Only the worker touches these.
+static std::vector<llvm::orc::VModuleKey> TierModules;
+static unsigned TierModulesEpoch = 0;
+
+// Called by the VM on the main thread when slot becomes hot.
+static void requestTierUp(unsigned slot) {
+  std::lock_guard<std::mutex> Lock(TierMutex);
+
+  // The VM enters machine code through callNative, so a function with more
+  // arguments than that can pass stays bytecode.
+  if (BytecodeFunctions[slot].numArgs > MaxNativeCallArgs)
+    return;
+
+  TierUpRequest R;
+  R.Epoch = TierEpoch;
+  std::vector<std::string> Work{BytecodeFunctions[slot].name};
+  while (!Work.empty()) {
+    std::string Name = Work.back();
+    Work.pop_back();
+    if (TierPending.count(Name))
+      continue;
+    // Externs are already native.
+    auto DI = FunctionDefs.find(Name);
+    if (DI == FunctionDefs.end())
+      continue;
+
+    // Callees with too many arguments are compiled along with the unit,
+    // but only machine code calls them.
+    TierPending.insert(Name);
+    R.Functions.push_back(DI->second);
+    bool Enterable = DI->second->getProto().getArgs().size() <= MaxNativeCallArgs;
+    R.Entries.push_back(Enterable ? &TieredEntries[BytecodeSlots[Name]] : nullptr);
+    DI->second->getCallees(Work);
+  }
+
+  if (R.Functions.empty())
+    return;
+  TierQueue.push_back(std::move(R));
+  TierCV.notify_one();
+}
+
+static void tierUp(TierUpRequest &R) {
+  {
+    std::lock_guard<std::mutex> Lock(TierMutex);
+    if (R.Epoch != TierEpoch)
+      return;
+  }
+
+  // Code of an earlier epoch is no longer published, so once the VM has
+  // left it nothing can enter it again.
+  if (R.Epoch != TierModulesEpoch) {
+    for (auto K : TierModules)
+      TheSession->RetiredModules.push_back({K, GlobalEpoch.fetch_add(1)});
+    TierModules.clear();
+    TierModulesEpoch = R.Epoch;
+  }
+  reclaimModules();
+
+  // Declare the whole unit first so the functions can call each other in
+  // any order. The main thread recorded the prototypes, but it may since
+  // have redefined a function with others.
+  CodeGen &CG = *TierCodeGen;
+  for (auto &Fn : R.Functions)
+    PrototypeAST(Fn->getProto()).codegen(CG);
+
+  std::vector<std::string> EntryNames;
+  unsigned Unit = TierUnits++;
+  for (auto &Fn : R.Functions) {
+    EntryNames.push_back("__tier" + std::to_string(Unit) + "_" + Fn->getName());
+    if (!Fn->codegen(CG) || !codegenCEntry(CG, Fn->getProto(), EntryNames.back())) {
+      fprintf(stderr, "Could not tier up %s\n", Fn->getName().c_str());
+      CG.newModule();
+      // Let the next hot function that reaches them try again.
+      std::lock_guard<std::mutex> Lock(TierMutex);
+      if (R.Epoch == TierEpoch)
+        for (auto &Failed : R.Functions)
+          TierPending.erase(Failed->getName());
+      return;
+    }
+  }
+
+  optimizeModule(*CG.Module, 3);
+  TierModules.push_back(TheSession->JIT->addModule(CG.takeModule()));
+  recycleCodeGen(TierCodeGen);
+
+  std::vector<void *> Addrs;
+  for (auto &Name : EntryNames)
+    Addrs.push_back((void *)TheSession->JIT->getSymbolAddress(Name));
+
+  std::lock_guard<std::mutex> Lock(TierMutex);
+  if (R.Epoch != TierEpoch)
+    return;
+  for (unsigned i = 0, e = Addrs.size(); i != e; ++i)
+    if (R.Entries[i])
+      R.Entries[i]->store(Addrs[i], std::memory_order_release);
+}
+
+static void tierUpWorker(Session *S) {
+  SessionScope Scope(S);
+  while (1) {
+    TierUpRequest R;
+    {
+      std::unique_lock<std::mutex> Lock(TierMutex);
+      TierCV.wait(Lock, [] { return TierShutdown || !TierQueue.empty(); });
+      if (TierShutdown)
+        return;
+      R = std::move(TierQueue.front());
+      TierQueue.pop_front();
+    }
+    tierUp(R);
+  }
+}
+
+static void startTiering(unsigned threshold) {
+  TierUpThreshold = threshold;
+  HotFunctionHook = requestTierUp;
+  TierCodeGen = std::make_unique<CodeGen>(TheSession->JIT->getTargetMachine().createDataLayout(), true);
+  TierWorker = std::thread(tierUpWorker, TheSession);
+}
+
+static void stopTiering() {
+  {
+    std::lock_guard<std::mutex> Lock(TierMutex);
+    TierShutdown = true;
+  }
+  TierCV.notify_one();
+  TierWorker.join();
+}
+
+// Add a definition as bytecode. Redefining a function throws away all tiered
+// code, since any of it may have inlined the old definition.
+static void addTieredDefinition(std::shared_ptr<FunctionAST> Fn) {
+  std::lock_guard<std::mutex> Lock(TierMutex);
+  if (!compileBytecodeDefinition(*Fn))
+    return;
+
+  // Recorded here rather than by the worker, which may be compiling an
+  // older definition.
+  addFunctionProto(Fn->getProto());
+  bool Redefined = FunctionDefs.count(Fn->getName());
+  FunctionDefs[Fn->getName()] = Fn;
+  if (!Redefined)
+    return;
+
+  TierEpoch++;
+  TierPending.clear();
+  for (auto &Entry : TieredEntries)
+    Entry.store(nullptr, std::memory_order_release);
+  for (auto &F : BytecodeFunctions)
+    F.calls = 0;
+}
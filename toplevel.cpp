@@ -0,0 +1,126 @@
+#include "ast.h"
+
+// Top-level expressions on the JIT backend. Compiling and linking a module
+// per expression costs far more than most expressions take to run, so:
+//
+// - A call with constant arguments, like `fib(30)`, compiles nothing. It
+//   goes through a trampoline for the callee's arity and calling convention,
+//   generated once and shared by every function of that shape.
+// - Unless input is interactive, other expressions are compiled into one
+//   module as __anon_exprN. The batch is linked and run, in order, when the
+//   next definition or extern comes along, at the end of input, or when it
+//   is full.
+
+static const unsigned MaxTopLevelBatch = 64;
+
+// When set, the value of every top-level expression evaluated on this thread
+// is also collected here, for a daemon client.
+static thread_local std::vector<double> *CollectedResults = nullptr;
+
+static void reportResult(double Result) {
+  if (TheSession->Echo)
+    fprintf(stderr, "Evaluated to %f\n", Result);
+  if (CollectedResults)
+    CollectedResults->push_back(Result);
+}
+
+// Returns the trampoline for functions of NumArgs doubles with calling
+// convention CC, or null. Caller holds JITMutex, and MainCodeGen's module
+// holds no batched expressions.
+static Trampoline getTrampoline(unsigned NumArgs, llvm::CallingConv::ID CC) {
+  auto &T = TheSession->Trampolines[{NumArgs, CC}];
+  if (T)
+    return T;
+
+  std::string Name = "__trampoline" + std::to_string(NumArgs) + "_" + std::to_string(CC);
+  if (!codegenTrampoline(*TheSession->MainCodeGen, NumArgs, CC, Name)) {
+    TheSession->MainCodeGen->newModule();
+    return nullptr;
+  }
+  TheSession->JIT->addModule(TheSession->MainCodeGen->takeModule());
+  recycleCodeGen(TheSession->MainCodeGen);
+  T = (Trampoline)(intptr_t)TheSession->JIT->getSymbolAddress(Name);
+  return T;
+}
+
+// Link and run the batched expressions.
+static void runTopLevelBatch() {
+  if (TheSession->TopLevelBatch.empty())
+    return;
+
+  std::unique_lock<std::mutex> Lock(TheSession->JITMutex);
+  auto H = TheSession->JIT->addModule(TheSession->MainCodeGen->takeModule());
+  recycleCodeGen(TheSession->MainCodeGen);
+  for (auto &Entry : TheSession->TopLevelBatch) {
+    // Takes no arguments, returns a double.
+    double (*FP)() = (double (*)())(intptr_t)TheSession->JIT->getSymbolAddress(Entry);
+    assert(FP && "Function not found");
+
+    // Lazy definitions compile on this thread as they are first called.
+    Lock.unlock();
+    double Result;
+    {
+      EpochGuard Guard;
+      Result = FP();
+    }
+    Lock.lock();
+    reportResult(Result);
+  }
+  TheSession->TopLevelBatch.clear();
+
+  TheSession->JIT->removeModule(H);
+  reclaimModules();
+}
+
+// Evaluate Fn if it is a call with constant arguments to a function the JIT
+// can call. Returns false to fall back to compiling it.
+static bool runConstantCall(FunctionAST &Fn) {
+  std::string Callee;
+  std::vector<double> Args;
+  if (!Fn.getConstantCall(Callee, Args))
+    return false;
+  auto P = findFunctionProto(Callee);
+  if (!P || P->getArgs().size() != Args.size())
+    return false;
+
+  // Everything before it has to have run.
+  runTopLevelBatch();
+
+  std::unique_lock<std::mutex> Lock(TheSession->JITMutex);
+  void *Addr = (void *)TheSession->JIT->getSymbolAddress(Callee);
+  if (!Addr)
+    return false;
+  Trampoline T = getTrampoline(Args.size(), P->getCallingConv());
+  if (!T)
+    return false;
+  speculateCallees(Fn);
+
+  Lock.unlock();
+  double Result;
+  {
+    EpochGuard Guard;
+    Result = T(Addr, Args.data());
+  }
+  reportResult(Result);
+  return true;
+}
+
+// Compile Fn into the batch, running the batch if it is full or batching is
+// off.
+static void addTopLevelExpr(FunctionAST &Fn) {
+  {
+    std::lock_guard<std::mutex> Lock(TheSession->JITMutex);
+    auto *FnIR = Fn.codegen(*TheSession->MainCodeGen);
+    if (!FnIR)
+      return;
+    TheSession->TopLevelBatch.push_back("__anon_expr" + std::to_string(TheSession->NextTopLevelEntry++));
+    FnIR->setName(TheSession->TopLevelBatch.back());
+    echoIR(FnIR);
+
+    // Start compiling what the expression calls while it runs.
+    speculateCallees(Fn);
+  }
+
+  if (!TheSession->BatchTopLevelExprs || TheSession->TopLevelBatch.size() >= MaxTopLevelBatch)
+    runTopLevelBatch();
+}
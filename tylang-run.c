@@ -0,0 +1,84 @@
+// tylang-run: run tylang on a zygote started with `tylang --zygote=SOCKET`.
+//
+//   tylang-run SOCKET [tylang options] [file.ty...]
+//
+// Sends the zygote this directory, the arguments and its own stdin, stdout
+// and stderr, waits for the job and exits with its status. It needs nothing
+// but libc, so it starts much faster than tylang itself.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s SOCKET [tylang arguments...]\n", argv[0]);
+    return 2;
+  }
+
+  struct sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", argv[1]);
+    return 2;
+  }
+  strcpy(Addr.sun_path, argv[1]);
+
+  int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Sock < 0 || connect(Sock, (struct sockaddr *)&Addr, sizeof(Addr)) != 0) {
+    perror(argv[1]);
+    return 2;
+  }
+
+  // The working directory, then each argument, NUL-terminated.
+  char Cwd[4096];
+  if (!getcwd(Cwd, sizeof(Cwd))) {
+    perror("getcwd");
+    return 2;
+  }
+  size_t Length = strlen(Cwd) + 1;
+  for (int i = 2; i < argc; i++)
+    Length += strlen(argv[i]) + 1;
+  char *Job = malloc(Length);
+  char *P = Job;
+  P = stpcpy(P, Cwd) + 1;
+  for (int i = 2; i < argc; i++)
+    P = stpcpy(P, argv[i]) + 1;
+
+  uint32_t Header = Length;
+  int Fds[3] = {0, 1, 2};
+  union {
+    struct cmsghdr Align;
+    char Buf[CMSG_SPACE(sizeof(Fds))];
+  } Control;
+  struct iovec IOV = {&Header, sizeof(Header)};
+  struct msghdr Msg;
+  memset(&Msg, 0, sizeof(Msg));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control.Buf;
+  Msg.msg_controllen = sizeof(Control.Buf);
+  struct cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  C->cmsg_level = SOL_SOCKET;
+  C->cmsg_type = SCM_RIGHTS;
+  C->cmsg_len = CMSG_LEN(sizeof(Fds));
+  memcpy(CMSG_DATA(C), Fds, sizeof(Fds));
+
+  if (sendmsg(Sock, &Msg, 0) != sizeof(Header) || send(Sock, Job, Length, 0) != (ssize_t)Length) {
+    perror("send");
+    return 2;
+  }
+  free(Job);
+
+  uint32_t Status;
+  if (recv(Sock, &Status, sizeof(Status), MSG_WAITALL) != sizeof(Status)) {
+    fprintf(stderr, "The zygote dropped the job\n");
+    return 2;
+  }
+  return Status;
+}
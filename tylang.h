@@ -0,0 +1,96 @@
+#ifndef TYLANG_H
+#define TYLANG_H
+
+// libtylang: compile and call tylang from C or C++. Build it with
+// `make lib`.
+//
+// Each session is a program of its own, with its own functions and JIT, and
+// shares nothing with other sessions. A session may only be used by one
+// thread at a time, but different sessions may be used from different
+// threads at once.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tylang_session tylang_session;
+
+// Compile definitions on a pool of n threads, shared by every session, while
+// tylang_compile parses on. 1, the default, compiles on the calling thread.
+// Call it before creating any session.
+void tylang_set_compile_threads(unsigned n);
+
+// Create a session holding the prelude and nothing else.
+tylang_session *tylang_session_create(void);
+
+// Free a session and everything compiled in it.
+void tylang_session_destroy(tylang_session *s);
+
+// Parse and compile source as a file would be: definitions, externs, imports
+// and top-level expressions, which are run. Returns 0 on success, or -1 if
+// anything failed to parse or compile, which tylang_error describes.
+int tylang_compile(tylang_session *s, const char *source);
+
+// What failed in the last tylang_compile or tylang_lookup, one error per
+// line. Empty if nothing did.
+const char *tylang_error(tylang_session *s);
+
+// The function name, which takes num_args doubles and returns a double, as a
+// pointer to call with the C calling convention. NULL if there is no such
+// function. The pointer stays valid until the session is destroyed, or name
+// is redefined and looked up again.
+void *tylang_lookup(tylang_session *s, const char *name, unsigned num_args);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace tylang {
+
+// Owns a tylang_session.
+class Session {
+public:
+  Session() : S(tylang_session_create()) {}
+  ~Session() {
+    if (S)
+      tylang_session_destroy(S);
+  }
+  Session(Session &&Other) : S(Other.S) { Other.S = nullptr; }
+  Session &operator=(Session &&Other) {
+    std::swap(S, Other.S);
+    return *this;
+  }
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  bool compile(const std::string &Source) { return tylang_compile(S, Source.c_str()) == 0; }
+  std::string error() const { return tylang_error(S); }
+
+  // The function Name with signature Fn, like
+  // lookup<double(double, double)>("add"). Null if there is none.
+  template <typename Fn> Fn *lookup(const std::string &Name) {
+    return reinterpret_cast<Fn *>(tylang_lookup(S, Name.c_str(), Arity<Fn>::value));
+  }
+
+  tylang_session *get() const { return S; }
+
+private:
+  template <typename> struct AsDouble { using type = double; };
+  template <typename Fn> struct Arity;
+  template <typename... Args> struct Arity<double(Args...)> {
+    static_assert(std::is_same<void(Args...), void(typename AsDouble<Args>::type...)>::value,
+                  "tylang functions only take doubles");
+    static const unsigned value = sizeof...(Args);
+  };
+
+  tylang_session *S;
+};
+
+} // namespace tylang
+
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#include "ast.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Zygote mode. --zygote=SOCKET initializes LLVM and the JIT once, runs a
+// throwaway function through them, then listens on a UNIX socket and forks a
+// child for every job, which starts with all of that already done. A job is
+// a command line, run as if tylang had been started with it, in the client's
+// working directory and with the client's stdin, stdout and stderr:
+//
+//   uint32_t length, sent along with the three descriptors (SCM_RIGHTS)
+//   <length bytes: the working directory, then each argument, NUL-terminated>
+//
+// When the child exits, the zygote sends back its exit status as a uint32_t,
+// 128 plus the signal number if it was killed. tylang-run.c is a client that
+// starts in a fraction of the time tylang does.
+
+static std::string ZygoteSocketPath;
+// Arguments and working directory together.
+static const uint32_t MaxZygoteJob = 1 << 20;
+
+// SIGCHLD writes to it, so the accept loop wakes up to report the status.
+static int ZygoteSignalPipe[2] = {-1, -1};
+
+static void onZygoteChildExit(int) {
+  int SavedErrno = errno;
+  char C = 0;
+  (void)!write(ZygoteSignalPipe[1], &C, 1);
+  errno = SavedErrno;
+}
+
+// Compile and call a function, so the children don't each fault in the code
+// generator, the passes and the linker on their first definition.
+static void warmUpJIT() {
+  CodeGen CG(TheSession->JIT->getTargetMachine().createDataLayout(), false);
+  auto *DoubleTy = CG.Builder.getDoubleTy();
+  auto *F = llvm::Function::Create(llvm::FunctionType::get(DoubleTy, {DoubleTy}, false),
+                                   llvm::Function::ExternalLinkage, "__zygote_warmup", CG.Module.get());
+  CG.Builder.SetInsertPoint(llvm::BasicBlock::Create(*CG.Context, "entry", F));
+  llvm::Value *X = F->getArg(0);
+  CG.Builder.CreateRet(CG.Builder.CreateFMul(X, CG.Builder.CreateFAdd(X, llvm::ConstantFP::get(DoubleTy, 1.0))));
+  CG.FPM->run(*F);
+
+  auto K = TheSession->JIT->addModule(CG.takeModule());
+  if (auto *Fn = (double (*)(double))(intptr_t)TheSession->JIT->getSymbolAddress("__zygote_warmup"))
+    Fn(1.0);
+  TheSession->JIT->removeModule(K);
+}
+
+// Read a job from Conn: the client's descriptors into Fds, and its working
+// directory and arguments into Args.
+static bool readZygoteJob(int Conn, int Fds[3], std::vector<std::string> &Args) {
+  uint32_t Length;
+  alignas(cmsghdr) char Control[CMSG_SPACE(3 * sizeof(int))];
+  iovec IOV = {&Length, sizeof(Length)};
+  msghdr Msg = {};
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+  if (recvmsg(Conn, &Msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(Length))
+    return false;
+
+  cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+  if (!C || C->cmsg_level != SOL_SOCKET || C->cmsg_type != SCM_RIGHTS)
+    return false;
+  if (C->cmsg_len != CMSG_LEN(3 * sizeof(int)) || (Msg.msg_flags & MSG_CTRUNC)) {
+    fprintf(stderr, "A zygote job must send stdin, stdout and stderr\n");
+    return false;
+  }
+  memcpy(Fds, CMSG_DATA(C), 3 * sizeof(int));
+
+  if (Length == 0 || Length > MaxZygoteJob)
+    return false;
+  std::string Buf(Length, '\0');
+  if (recv(Conn, &Buf[0], Length, MSG_WAITALL) != (ssize_t)Length || Buf.back() != '\0')
+    return false;
+  for (size_t I = 0; I < Buf.size(); I += Args.back().size() + 1)
+    Args.push_back(Buf.c_str() + I);
+  return true;
+}
+
+// In the child: take over the client's descriptors and directory and run the
+// job. Never returns.
+[[noreturn]] static void runZygoteJob(int Conn, const std::function<int(std::vector<std::string> &)> &RunJob) {
+  signal(SIGCHLD, SIG_DFL);
+  close(ZygoteSignalPipe[0]);
+  close(ZygoteSignalPipe[1]);
+
+  int Fds[3];
+  std::vector<std::string> Args;
+  if (!readZygoteJob(Conn, Fds, Args))
+    _exit(1);
+  close(Conn);
+
+  for (int I = 0; I != 3; ++I)
+    dup2(Fds[I], I);
+  for (int I = 0; I != 3; ++I)
+    if (Fds[I] > 2)
+      close(Fds[I]);
+
+  if (chdir(Args[0].c_str()) != 0) {
+    fprintf(stderr, "Could not change to %s\n", Args[0].c_str());
+    exit(1);
+  }
+  // The directory's slot becomes argv[0].
+  Args[0] = Argv0;
+  exit(RunJob(Args));
+}
+
+// Create a UNIX socket listening on Path, replacing any socket left behind
+// there. Returns -1 after saying why if it can't.
+static int listenOnUnixSocket(const std::string &Path) {
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", Path.c_str());
+    return -1;
+  }
+  strcpy(Addr.sun_path, Path.c_str());
+
+  int Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(Path.c_str());
+  if (Listener < 0 || bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) != 0 || listen(Listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", Path.c_str(), strerror(errno));
+    if (Listener >= 0)
+      close(Listener);
+    return -1;
+  }
+  return Listener;
+}
+
+// Listen on Path and run every job that connects with RunJob, in a child
+// forked from this process. Only returns if the socket can't be set up.
+static int runZygote(const std::string &Path, const std::function<int(std::vector<std::string> &)> &RunJob) {
+  int Listener = listenOnUnixSocket(Path);
+  if (Listener < 0)
+    return 1;
+  if (pipe2(ZygoteSignalPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    fprintf(stderr, "Could not create a pipe: %s\n", strerror(errno));
+    return 1;
+  }
+  struct sigaction SA = {};
+  SA.sa_handler = onZygoteChildExit;
+  SA.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &SA, nullptr);
+  fprintf(stderr, "Zygote listening on %s\n", Path.c_str());
+
+  // The connection each running job's status goes to.
+  std::map<pid_t, int> Jobs;
+  while (true) {
+    pollfd Fds[2] = {{Listener, POLLIN, 0}, {ZygoteSignalPipe[0], POLLIN, 0}};
+    if (poll(Fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      return 1;
+    }
+
+    if (Fds[1].revents & POLLIN) {
+      char Buf[64];
+      while (read(ZygoteSignalPipe[0], Buf, sizeof(Buf)) > 0)
+        ;
+      int Status;
+      pid_t Pid;
+      while ((Pid = waitpid(-1, &Status, WNOHANG)) > 0) {
+        auto I = Jobs.find(Pid);
+        if (I == Jobs.end())
+          continue;
+        uint32_t Code = WIFEXITED(Status) ? WEXITSTATUS(Status) : 128 + WTERMSIG(Status);
+        send(I->second, &Code, sizeof(Code), MSG_NOSIGNAL);
+        close(I->second);
+        Jobs.erase(I);
+      }
+    }
+
+    if (Fds[0].revents & POLLIN) {
+      int Conn = accept4(Listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (Conn < 0)
+        continue;
+      // Or the child would write out whatever is still buffered too.
+      fflush(stdout);
+      fflush(stderr);
+      pid_t Pid = fork();
+      if (Pid == 0) {
+        close(Listener);
+        for (auto &J : Jobs)
+          close(J.second);
+        runZygoteJob(Conn, RunJob);
+      }
+      if (Pid < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        close(Conn);
+        continue;
+      }
+      // The child reads the job itself, so a slow client holds up no one.
+      Jobs[Pid] = Conn;
+    }
+  }
+}